@@ -0,0 +1,50 @@
+#include "checksum.hpp"
+
+namespace nq {
+
+// Appending zeroes to a block is a linear operation on its crc, represented as 32x32 matrices over GF(2)
+static std::uint32_t gf2_matrix_times(const std::uint32_t *mat, std::uint32_t vec) {
+    std::uint32_t sum = 0;
+    for (; vec; vec >>= 1, ++mat)
+        if (vec & 1)
+            sum ^= *mat;
+    return sum;
+}
+
+static void gf2_matrix_square(std::uint32_t *square, const std::uint32_t *mat) {
+    for (int i = 0; i < 32; ++i)
+        square[i] = gf2_matrix_times(mat, mat[i]);
+}
+
+std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2) {
+    if (size2 == 0)
+        return crc1;
+
+    // Operator for a single zero bit
+    std::uint32_t even[32], odd[32];
+    odd[0] = 0xedb88320;
+    for (int i = 1; i < 32; ++i)
+        odd[i] = 1u << (i - 1);
+
+    // Operators for one then two zero bytes
+    gf2_matrix_square(even, odd);
+    gf2_matrix_square(odd, even);
+
+    // Apply size2 zero bytes to crc1, squaring the operator for each bit of the size
+    do {
+        gf2_matrix_square(even, odd);
+        if (size2 & 1)
+            crc1 = gf2_matrix_times(even, crc1);
+        if (!(size2 >>= 1))
+            break;
+
+        gf2_matrix_square(odd, even);
+        if (size2 & 1)
+            crc1 = gf2_matrix_times(odd, crc1);
+        size2 >>= 1;
+    } while (size2);
+
+    return crc1 ^ crc2;
+}
+
+} // namespace nq
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <cstring>
+
+#ifdef __ARM_FEATURE_CRC32
+#   include <arm_acle.h>
+#endif
+
+namespace nq {
+
+namespace impl {
+
+constexpr inline auto crc32_table = [] {
+    std::array<std::uint32_t, 256> table = {};
+    for (std::uint32_t i = 0; i < table.size(); ++i) {
+        auto c = i;
+        for (int j = 0; j < 8; ++j)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        table[i] = c;
+    }
+    return table;
+}();
+
+} // namespace impl
+
+// Standard crc32 (as in zlib/zip), computed with the armv8 crc instructions when the target has them
+static inline std::uint32_t crc32(const void *data, std::size_t size, std::uint32_t crc = 0) {
+    auto *bytes = static_cast<const std::uint8_t *>(data);
+    crc = ~crc;
+#ifdef __ARM_FEATURE_CRC32
+    for (; size && (reinterpret_cast<std::uintptr_t>(bytes) & 7); --size)
+        crc = __crc32b(crc, *bytes++);
+    for (; size >= sizeof(std::uint64_t); size -= sizeof(std::uint64_t), bytes += sizeof(std::uint64_t)) {
+        std::uint64_t v;
+        std::memcpy(&v, bytes, sizeof(v));
+        crc = __crc32d(crc, v);
+    }
+    for (; size; --size)
+        crc = __crc32b(crc, *bytes++);
+#else
+    for (; size; --size)
+        crc = impl::crc32_table[(crc ^ *bytes++) & 0xff] ^ (crc >> 8);
+#endif
+    return ~crc;
+}
+
+// Crc32 of two concatenated blocks, from the crc of each and the size of the second one
+std::uint32_t crc32_combine(std::uint32_t crc1, std::uint32_t crc2, std::uint64_t size2);
+
+} // namespace nq
@@ -0,0 +1,113 @@
+#include <algorithm>
+
+#include "commit_scheduler.hpp"
+
+namespace nq::fs {
+
+CommitScheduler::CommitScheduler(const Filesystem &fs): fs(fs) {
+    R_TRY_RETURNV(threadCreate(&this->thread, &CommitScheduler::thread_func, this, nullptr, stack_size, priority, -2), );
+    if (R_FAILED(threadStart(&this->thread))) {
+        ERROR("Failed to start commit thread\n");
+        threadClose(&this->thread);
+        return;
+    }
+    this->thread_started = true;
+}
+
+CommitScheduler::~CommitScheduler() {
+    if (this->thread_started) {
+        {
+            std::lock_guard lk(this->mutex);
+            this->exiting = true;
+        }
+        this->cv.notify_all();
+
+        threadWaitForExit(&this->thread);
+        threadClose(&this->thread);
+    }
+
+    this->commit();
+}
+
+void CommitScheduler::begin_write() {
+    std::unique_lock lk(this->mutex);
+    this->cv.wait(lk, [this] { return !this->committing; });
+
+    if (!this->dirty)
+        this->first_write = Clock::now();
+    this->dirty = true;
+    ++this->active_writes;
+}
+
+void CommitScheduler::end_write(std::uint64_t size) {
+    {
+        std::lock_guard lk(this->mutex);
+        --this->active_writes;
+        this->pending_size += size;
+        this->last_write    = Clock::now();
+    }
+    this->cv.notify_all();
+
+    // Without a thread, fall back to committing every write
+    if (!this->thread_started)
+        this->commit();
+}
+
+Result CommitScheduler::commit() {
+    std::unique_lock lk(this->mutex);
+    this->cv.wait(lk, [this] { return !this->committing; });
+    if (!this->dirty || this->active_writes)
+        return Result::success();
+    return this->do_commit(lk);
+}
+
+Result CommitScheduler::do_commit(std::unique_lock<std::mutex> &lk) {
+    auto size = this->pending_size;
+    this->committing   = true;
+    this->dirty        = false;
+    this->pending_size = 0;
+
+    lk.unlock();
+    auto start = Clock::now();
+    Result rc  = this->fs.flush();
+    auto latency = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start);
+    lk.lock();
+
+    this->committing = false;
+    if (rc.succeeded()) {
+        ++this->stats.nb_commits;
+        this->stats.committed_size += size;
+        this->stats.total_latency  += latency;
+        this->stats.max_latency     = std::max(this->stats.max_latency, latency);
+        TRACE("Committed %#lx bytes in %lu us\n", size, latency.count() / 1000);
+    } else {
+        // Not retried until the next write, closing the filesystem commits anyway
+        ++this->stats.nb_failures;
+        ERROR("Commit failed with %#x\n", rc.code());
+    }
+
+    this->cv.notify_all();
+    return rc;
+}
+
+void CommitScheduler::thread_func(void *args) {
+    auto *self = static_cast<CommitScheduler *>(args);
+
+    std::unique_lock lk(self->mutex);
+    while (!self->exiting) {
+        if (!self->dirty || self->active_writes || self->committing) {
+            self->cv.wait(lk);
+            continue;
+        }
+
+        auto deadline = std::min(self->last_write + idle_delay, self->first_write + max_delay);
+        if ((self->pending_size < max_pending_size) && (Clock::now() < deadline)) {
+            self->cv.wait_until(lk, deadline);
+            continue;
+        }
+
+        self->do_commit(lk);
+    }
+}
+
+} // namespace nq::fs
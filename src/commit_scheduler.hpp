@@ -0,0 +1,97 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <condition_variable>
+#include <mutex>
+#include <switch.h>
+
+#include "fs.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+// Batches filesystem commits. Writes are bracketed by begin_write/end_write, and a background thread commits
+// once no write is in flight and either the burst has ended, enough data piled up, or the oldest uncommitted
+// write is getting old. Bulk transfers of small files then pay for one commit instead of one per file
+class CommitScheduler {
+    NON_COPYABLE(CommitScheduler);
+    NON_MOVEABLE(CommitScheduler);
+
+    public:
+        constexpr static auto          idle_delay       = std::chrono::milliseconds(500); // Quiet time ending a burst
+        constexpr static auto          max_delay        = std::chrono::seconds(5);
+        constexpr static std::uint64_t max_pending_size = 0x2000000; // 32 MiB
+
+        constexpr static std::size_t stack_size = 0x4000;
+        constexpr static int         priority   = 0x2c;
+
+        struct Stats {
+            std::uint32_t            nb_commits     = 0;
+            std::uint32_t            nb_failures    = 0;
+            std::uint64_t            committed_size = 0;
+            std::chrono::nanoseconds total_latency  = {};
+            std::chrono::nanoseconds max_latency    = {};
+        };
+
+        // Scoped write, the size is accounted for when it ends
+        class Write {
+            NON_COPYABLE(Write);
+            NON_MOVEABLE(Write);
+
+            public:
+                inline Write(CommitScheduler &scheduler, std::uint64_t size = 0): scheduler(scheduler), size(size) {
+                    this->scheduler.begin_write();
+                }
+
+                inline ~Write() {
+                    this->scheduler.end_write(this->size);
+                }
+
+                inline void add_size(std::uint64_t size) {
+                    this->size += size;
+                }
+
+            private:
+                CommitScheduler &scheduler;
+                std::uint64_t    size;
+        };
+
+        CommitScheduler(const Filesystem &fs);
+        ~CommitScheduler(); // Commits pending writes
+
+        // Waits for an ongoing commit, since commits can't overlap writes
+        void begin_write();
+        void end_write(std::uint64_t size);
+
+        // Commits pending writes now, must not be called with a write in flight on this thread
+        Result commit();
+
+        inline Stats get_stats() {
+            std::lock_guard lk(this->mutex);
+            return this->stats;
+        }
+
+    private:
+        using Clock = std::chrono::steady_clock;
+
+        static void thread_func(void *args);
+        Result do_commit(std::unique_lock<std::mutex> &lk);
+
+    private:
+        Filesystem fs;
+
+        Thread                  thread         = {};
+        bool                    thread_started = false;
+        std::mutex              mutex;
+        std::condition_variable cv;
+
+        std::uint32_t     active_writes = 0;
+        bool              dirty = false, committing = false, exiting = false;
+        std::uint64_t     pending_size = 0;
+        Clock::time_point first_write = {}, last_write = {};
+
+        Stats stats;
+};
+
+} // namespace nq::fs
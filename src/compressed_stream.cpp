@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "compressed_stream.hpp"
+#include "error.hpp"
+
+namespace nq::fs {
+
+Result FramePipeline::start(ThreadFunc func) {
+    this->slots = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[slot_size * nb_slots]);
+    this->raw   = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[frame_size]);
+    TRY_RETURNV(this->slots && this->raw, Result::failure());
+
+    R_TRY_RETURN(threadCreate(&this->thread, func, this, nullptr, stack_size, priority, -2));
+    if (Result rc = threadStart(&this->thread); rc.failed()) {
+        threadClose(&this->thread);
+        return rc;
+    }
+    this->thread_started = true;
+    return Result::success();
+}
+
+void FramePipeline::stop() {
+    if (!this->thread_started)
+        return;
+
+    {
+        std::lock_guard lk(this->mutex);
+        if (!this->producer_done)
+            this->aborted = true;
+        this->cv.notify_all();
+    }
+
+    threadWaitForExit(&this->thread);
+    threadClose(&this->thread);
+    this->thread_started = false;
+}
+
+std::uint8_t *FramePipeline::acquire_free() {
+    std::unique_lock lk(this->mutex);
+    this->cv.wait(lk, [this] { return this->aborted || (this->head - this->tail < nb_slots); });
+    return this->aborted ? nullptr : this->slots.get() + (this->head % nb_slots) * slot_size;
+}
+
+void FramePipeline::commit(std::size_t size) {
+    // The slot is owned by the producer until head is advanced
+    std::lock_guard lk(this->mutex);
+    this->slot_sizes[this->head % nb_slots] = size;
+    ++this->head;
+    this->cv.notify_all();
+}
+
+std::uint8_t *FramePipeline::acquire_full(std::size_t &size) {
+    std::unique_lock lk(this->mutex);
+    this->cv.wait(lk, [this] { return this->aborted || this->producer_done || (this->head != this->tail); });
+    if (this->aborted || (this->head == this->tail))
+        return nullptr;
+    size = this->slot_sizes[this->tail % nb_slots];
+    return this->slots.get() + (this->tail % nb_slots) * slot_size;
+}
+
+void FramePipeline::release() {
+    std::lock_guard lk(this->mutex);
+    ++this->tail;
+    this->cv.notify_all();
+}
+
+void FramePipeline::end_production(Result rc) {
+    std::lock_guard lk(this->mutex);
+    if (this->rc.succeeded())
+        this->rc = rc;
+    this->producer_done = true;
+    this->cv.notify_all();
+}
+
+void FrameCompressor::worker_func(void *args) {
+    auto *self = static_cast<FrameCompressor *>(args);
+    self->end_production(self->compress_file());
+}
+
+Result FrameCompressor::compress_file() {
+    for (std::uint64_t offset = 0; offset < this->size;) {
+        auto raw_size = static_cast<std::size_t>(std::min<std::uint64_t>(frame_size, this->size - offset));
+        TRY_RETURNV(this->file.read(this->raw.get(), raw_size, offset) == raw_size, err::ShortFsRead);
+        if (this->hasher)
+            this->hasher->update(this->raw.get(), raw_size);
+
+        auto *slot = this->acquire_free();
+        if (!slot)
+            return err::CopyAborted;
+
+        // Incompressible data is stored as is, so that frames never grow
+        auto *data = slot + sizeof(FrameHeader);
+        auto data_size = lz4::compress(this->raw.get(), raw_size, data, raw_size - 1);
+        if (data_size == 0) {
+            std::memcpy(data, this->raw.get(), raw_size);
+            data_size = raw_size;
+        }
+
+        FrameHeader header = { static_cast<std::uint32_t>(raw_size), static_cast<std::uint32_t>(data_size) };
+        std::memcpy(slot, &header, sizeof(header));
+        this->commit(sizeof(header) + data_size);
+        offset += raw_size;
+    }
+
+    return Result::success();
+}
+
+std::size_t FrameCompressor::read(void *buf, std::size_t size) {
+    auto *out = static_cast<std::uint8_t *>(buf);
+    std::size_t written = 0;
+
+    while (written < size) {
+        if (!this->cur) {
+            this->cur_offset = 0;
+            if (this->cur = this->acquire_full(this->cur_size); !this->cur)
+                break;
+        }
+
+        auto len = std::min(this->cur_size - this->cur_offset, size - written);
+        std::copy_n(this->cur + this->cur_offset, len, out + written);
+        this->cur_offset += len, written += len;
+
+        if (this->cur_offset == this->cur_size) {
+            this->cur = nullptr;
+            this->release();
+        }
+    }
+
+    this->compressed_size += written;
+    return written;
+}
+
+Result FrameCompressor::finish() {
+    this->stop();
+    return this->get_result();
+}
+
+void FrameDecompressor::worker_func(void *args) {
+    auto *self = static_cast<FrameDecompressor *>(args);
+    if (auto rc = self->decompress_file(); rc.failed())
+        self->abort(rc);
+}
+
+Result FrameDecompressor::decompress_file() {
+    std::uint64_t offset = 0;
+
+    std::size_t size;
+    while (auto *slot = this->acquire_full(size)) {
+        FrameHeader header;
+        std::memcpy(&header, slot, sizeof(header));
+        TRY_RETURNV(header.raw_size <= this->size - offset, err::SizeMismatch);
+
+        auto *data = slot + sizeof(FrameHeader);
+        if (header.data_size != header.raw_size) {
+            TRY_RETURNV(lz4::decompress(data, header.data_size, this->raw.get(), header.raw_size), err::InvalidFrame);
+            data = this->raw.get();
+        }
+
+        R_TRY_RETURN(this->file.write(data, header.raw_size, offset));
+        if (this->hasher)
+            this->hasher->update(data, header.raw_size);
+        offset += header.raw_size;
+
+        this->release();
+    }
+
+    TRY_RETURNV(offset == this->size, err::SizeMismatch);
+    return Result::success();
+}
+
+void FrameDecompressor::feed(const void *data, std::size_t size) {
+    auto *in = static_cast<const std::uint8_t *>(data);
+
+    while (size && !this->discarding) {
+        if (!this->cur) {
+            if (this->cur = this->acquire_free(); !this->cur) {
+                this->discarding = true;
+                break;
+            }
+            this->cur_fill = 0, this->cur_size = sizeof(FrameHeader);
+        }
+
+        auto len = std::min(this->cur_size - this->cur_fill, size);
+        std::copy_n(in, len, this->cur + this->cur_fill);
+        this->cur_fill += len, in += len, size -= len;
+
+        if (this->cur_fill < this->cur_size)
+            continue;
+
+        if (this->cur_size == sizeof(FrameHeader)) {
+            // Frames are validated before they are buffered, the data size bounds the copy into the slot
+            FrameHeader header;
+            std::memcpy(&header, this->cur, sizeof(header));
+            if ((header.raw_size == 0) || (header.raw_size > frame_size) ||
+                    (header.data_size > lz4::compress_bound(header.raw_size))) {
+                ERROR("Invalid compressed frame (raw size %#x, data size %#x)\n", header.raw_size, header.data_size);
+                this->abort(err::InvalidFrame);
+                this->discarding = true;
+                break;
+            }
+            this->cur_size += header.data_size;
+            if (this->cur_fill < this->cur_size)
+                continue;
+        }
+
+        this->commit(this->cur_size);
+        this->cur = nullptr;
+    }
+}
+
+Result FrameDecompressor::finish() {
+    if (this->cur && !this->discarding) {
+        ERROR("Compressed stream was cut short\n");
+        this->abort(err::InvalidFrame);
+    }
+
+    this->end_production();
+    this->stop();
+    return this->get_result();
+}
+
+} // namespace nq::fs
@@ -0,0 +1,165 @@
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <switch.h>
+
+#include "content_hasher.hpp"
+#include "fs.hpp"
+#include "lz4.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+// Compressed streams are a sequence of independent frames, each a header followed by an LZ4 block, or by the raw
+// data when it didn't compress
+struct FrameHeader {
+    std::uint32_t raw_size;
+    std::uint32_t data_size; // Equal to raw_size for stored frames
+};
+ASSERT_SIZE(FrameHeader, 0x8);
+ASSERT_STANDARD_LAYOUT(FrameHeader);
+
+// Moves compression off the usb thread: a worker thread handles one frame while the caller transfers the ones
+// next to it, through a ring of frame slots. The file is read or written on the worker as well
+class FramePipeline {
+    NON_COPYABLE(FramePipeline);
+    NON_MOVEABLE(FramePipeline);
+
+    public:
+        constexpr static std::size_t frame_size = 0x100000; // Largest raw size of a frame, 1 MiB
+        constexpr static std::size_t slot_size  = sizeof(FrameHeader) + lz4::compress_bound(frame_size);
+        constexpr static std::size_t nb_slots   = 4;
+
+        constexpr static std::size_t stack_size = 0x10000;
+        constexpr static int         priority   = 0x2c;
+
+    protected:
+        FramePipeline(File &file, std::uint64_t size, StreamHasher *hasher): file(file), size(size), hasher(hasher) { }
+
+        inline ~FramePipeline() {
+            this->stop();
+        }
+
+        Result start(ThreadFunc func);
+
+        // Aborts the other side if needed, and waits for the worker
+        void stop();
+
+        // Slot to produce the next frame into, nullptr once aborted
+        std::uint8_t *acquire_free();
+        void commit(std::size_t size);
+
+        // Next frame to consume, nullptr once the producer is done and the ring drained, or aborted
+        std::uint8_t *acquire_full(std::size_t &size);
+        void release();
+
+        // Called by whichever side runs out of work first
+        void end_production(Result rc = Result::success());
+
+        inline void abort(Result rc) {
+            std::lock_guard lk(this->mutex);
+            if (this->rc.succeeded())
+                this->rc = rc;
+            this->aborted = true;
+            this->cv.notify_all();
+        }
+
+        inline Result get_result() {
+            std::lock_guard lk(this->mutex);
+            return this->rc;
+        }
+
+    protected:
+        File         &file;
+        std::uint64_t size;
+        StreamHasher *hasher;
+
+        std::unique_ptr<std::uint8_t[]> raw; // Uncompressed data of the frame the worker is on
+
+    private:
+        std::unique_ptr<std::uint8_t[]> slots;
+        std::size_t                     slot_sizes[nb_slots] = {};
+
+        Thread                  thread         = {};
+        bool                    thread_started = false;
+        std::mutex              mutex;
+        std::condition_variable cv;
+        std::size_t             head = 0, tail = 0; // Next slot to fill/drain
+        bool                    producer_done = false, aborted = false;
+        Result                  rc = Result::success();
+};
+
+// Reads a file into compressed frames, pulled by the caller as a byte stream
+class FrameCompressor: public FramePipeline {
+    public:
+        FrameCompressor(File &file, std::uint64_t size, StreamHasher *hasher = nullptr):
+            FramePipeline(file, size, hasher) { }
+
+        // The worker must be gone before members of this class are
+        inline ~FrameCompressor() {
+            this->stop();
+        }
+
+        inline Result start() {
+            return FramePipeline::start(&FrameCompressor::worker_func);
+        }
+
+        // Returns less than size only at the end of the stream, or when the worker failed
+        std::size_t read(void *buf, std::size_t size);
+
+        // Fails if the worker did, in which case the stream was cut short
+        Result finish();
+
+        inline std::uint64_t get_compressed_size() const {
+            return this->compressed_size;
+        }
+
+    private:
+        static void worker_func(void *args);
+        Result compress_file();
+
+    private:
+        std::uint8_t *cur        = nullptr;
+        std::size_t   cur_size   = 0, cur_offset = 0;
+        std::uint64_t compressed_size = 0;
+};
+
+// Writes a file from compressed frames, fed by the caller in arbitrary chunks as they arrive
+class FrameDecompressor: public FramePipeline {
+    public:
+        FrameDecompressor(File &file, std::uint64_t size, StreamHasher *hasher = nullptr):
+            FramePipeline(file, size, hasher) { }
+
+        // The worker must be gone before members of this class are
+        inline ~FrameDecompressor() {
+            this->stop();
+        }
+
+        // On failure the stream is still consumed, and the error reported by finish
+        inline Result start() {
+            auto rc = FramePipeline::start(&FrameDecompressor::worker_func);
+            if (rc.failed())
+                this->abort(rc);
+            return rc;
+        }
+
+        // Data past a failure is discarded, so that the remainder of the stream is still consumed in sync
+        void feed(const void *data, std::size_t size);
+
+        // Fails if the stream was cut short, a frame was invalid, or the output doesn't have the expected size
+        Result finish();
+
+    private:
+        static void worker_func(void *args);
+        Result decompress_file();
+
+    private:
+        std::uint8_t *cur      = nullptr;
+        std::size_t   cur_fill = 0, cur_size = 0; // Frame size is unknown until the header is complete
+        bool          discarding = false;
+};
+
+} // namespace nq::fs
@@ -0,0 +1,106 @@
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <new>
+
+#include "content_hasher.hpp"
+#include "error.hpp"
+
+namespace nq::fs {
+
+void ContentHasher::run(ThreadPool *pool) {
+    struct Chunk {
+        std::size_t   file;
+        std::uint64_t offset;
+    };
+
+    std::vector<Chunk> chunks;
+    for (std::size_t i = 0; i < this->files.size(); ++i) {
+        auto &file = this->files[i];
+        file.chunks.resize((file.size + chunk_size - 1) / chunk_size);
+        file.chunk_crcs.resize(file.chunks.size());
+        for (std::size_t j = 0; j < file.chunks.size(); ++j)
+            chunks.push_back({ i, j * chunk_size });
+    }
+
+    // Results only need to be serialized for failures, digests land in distinct slots
+    std::mutex mutex;
+    auto hash = [&](std::size_t idx) {
+        auto &chunk = chunks[idx];
+        auto &file  = this->files[chunk.file];
+        auto idx_in_file = chunk.offset / chunk_size;
+        if (auto rc = this->hash_chunk(file, chunk.offset, file.chunks[idx_in_file], file.chunk_crcs[idx_in_file]); rc.failed()) {
+            std::lock_guard lk(mutex);
+            file.rc = rc;
+        }
+    };
+
+    if (pool) {
+        pool->parallel_for(chunks.size(), hash);
+    } else {
+        for (std::size_t i = 0; i < chunks.size(); ++i)
+            hash(i);
+    }
+
+    for (auto &&file: this->files) {
+        if (file.rc.succeeded()) {
+            sha256CalculateHash(file.digest.data(), file.chunks.data(), file.chunks.size() * sizeof(Digest));
+            for (std::size_t i = 0; i < file.chunk_crcs.size(); ++i)
+                file.crc = crc32_combine(file.crc, file.chunk_crcs[i], std::min(chunk_size, file.size - i * chunk_size));
+        }
+        file.chunks = {}, file.chunk_crcs = {};
+    }
+}
+
+Result ContentHasher::hash_chunk(Entry &file, std::uint64_t offset, Digest &digest, std::uint32_t &crc) {
+    auto buf = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[read_size]);
+    TRY_RETURNV(buf != nullptr, Result::failure());
+
+    File f;
+    R_TRY_RETURN(this->fs.open_file(f, file.path));
+    SCOPE_GUARD([&f] { f.close(); });
+
+    Sha256Context ctx;
+    sha256ContextCreate(&ctx);
+
+    crc = 0;
+    auto end = std::min(offset + chunk_size, file.size);
+    while (offset < end) {
+        auto size = std::min<std::uint64_t>(read_size, end - offset);
+        TRY_RETURNV(f.read(buf.get(), size, offset) == size, err::ShortFsRead);
+        sha256ContextUpdate(&ctx, buf.get(), size);
+        crc = crc32(buf.get(), size, crc);
+        offset += size;
+    }
+
+    sha256ContextGetHash(&ctx, digest.data());
+    return Result::success();
+}
+
+void StreamHasher::update(const void *data, std::size_t size) {
+    this->crc = crc32(data, size, this->crc);
+
+    // Split the data on chunk boundaries
+    auto *bytes = static_cast<const std::uint8_t *>(data);
+    while (size) {
+        auto chunk_offset = this->size % ContentHasher::chunk_size;
+        auto len = static_cast<std::size_t>(std::min<std::uint64_t>(size, ContentHasher::chunk_size - chunk_offset));
+        sha256ContextUpdate(&this->ctx, bytes, len);
+        bytes += len, size -= len, this->size += len;
+
+        if (this->size % ContentHasher::chunk_size == 0) {
+            sha256ContextGetHash(&this->ctx, this->chunks.emplace_back().data());
+            sha256ContextCreate(&this->ctx);
+        }
+    }
+}
+
+void StreamHasher::finish(Digest &digest, std::uint32_t &crc) {
+    if (this->size % ContentHasher::chunk_size)
+        sha256ContextGetHash(&this->ctx, this->chunks.emplace_back().data());
+
+    sha256CalculateHash(digest.data(), this->chunks.data(), this->chunks.size() * sizeof(Digest));
+    crc = this->crc;
+}
+
+} // namespace nq::fs
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <switch.h>
+
+#include "checksum.hpp"
+#include "fs.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+// Hashes a batch of files on a thread pool. Files are split in fixed-size chunks, each hashed with SHA-256
+// independently, and the content hash is the SHA-256 of the chunk digests. Chunks of all files are spread
+// over the pool, so that both large files and batches of small ones use every core. A crc32 is computed alongside
+class ContentHasher {
+    NON_COPYABLE(ContentHasher);
+    NON_MOVEABLE(ContentHasher);
+
+    public:
+        using Digest = std::array<std::uint8_t, SHA256_HASH_SIZE>;
+
+        constexpr static std::uint64_t chunk_size = 0x400000; // 4 MiB
+        constexpr static std::size_t   read_size  = 0x100000; // 1 MiB
+
+        ContentHasher(Filesystem &fs): fs(fs) { }
+
+        inline std::size_t add_file(std::string path, std::uint64_t size) {
+            this->files.push_back({ std::move(path), size });
+            return this->files.size() - 1;
+        }
+
+        inline bool empty() const {
+            return this->files.empty();
+        }
+
+        // Runs inline without a pool
+        void run(ThreadPool *pool);
+
+        inline Result get_result(std::size_t idx, Digest &digest, std::uint32_t &crc) const {
+            digest = this->files[idx].digest;
+            crc    = this->files[idx].crc;
+            return this->files[idx].rc;
+        }
+
+    private:
+        struct Entry {
+            std::string                path;
+            std::uint64_t              size;
+            std::vector<Digest>        chunks     = {};
+            std::vector<std::uint32_t> chunk_crcs = {};
+            Digest                     digest     = {};
+            std::uint32_t              crc        = 0;
+            Result                     rc         = Result::success();
+        };
+
+        Result hash_chunk(Entry &file, std::uint64_t offset, Digest &digest, std::uint32_t &crc);
+
+    private:
+        Filesystem        &fs;
+        std::vector<Entry> files;
+};
+
+// Computes the same content hash and crc32 as ContentHasher over data fed in order, as it goes through a transfer
+class StreamHasher {
+    NON_COPYABLE(StreamHasher);
+    NON_MOVEABLE(StreamHasher);
+
+    public:
+        using Digest = ContentHasher::Digest;
+
+        inline StreamHasher() {
+            sha256ContextCreate(&this->ctx);
+        }
+
+        void update(const void *data, std::size_t size);
+
+        // Ends the stream, the hasher can't be updated afterwards
+        void finish(Digest &digest, std::uint32_t &crc);
+
+        inline std::uint64_t get_size() const {
+            return this->size;
+        }
+
+    private:
+        Sha256Context       ctx;
+        std::uint64_t       size = 0;
+        std::uint32_t       crc  = 0;
+        std::vector<Digest> chunks;
+};
+
+} // namespace nq::fs
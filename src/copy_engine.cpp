@@ -0,0 +1,131 @@
+#include "copy_engine.hpp"
+#include "error.hpp"
+
+namespace nq::fs {
+
+Result CopyEngine::run(const ProgressCallback &progress) {
+    if (this->total_size == 0)
+        return this->write_files(progress);
+
+    this->buffers = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[buffer_size * nb_buffers]);
+    TRY_RETURNV(this->buffers != nullptr, Result::failure());
+    this->head = this->tail = 0, this->reader_done = this->aborted = false;
+
+    Thread reader;
+    R_TRY_RETURN(threadCreate(&reader, &CopyEngine::reader_func, this, nullptr, 0x10000, 0x2c, -2));
+    if (Result rc = threadStart(&reader); rc.failed()) {
+        threadClose(&reader);
+        this->buffers.reset();
+        return rc;
+    }
+
+    auto rc = this->write_files(progress);
+
+    if (rc.failed()) {
+        std::lock_guard lk(this->mutex);
+        this->aborted = true;
+        this->cv.notify_all();
+    }
+
+    threadWaitForExit(&reader);
+    threadClose(&reader);
+    this->buffers.reset();
+
+    return rc.failed() ? rc : this->reader_rc;
+}
+
+void CopyEngine::reader_func(void *args) {
+    auto *self = static_cast<CopyEngine *>(args);
+    auto rc = self->read_files();
+
+    std::lock_guard lk(self->mutex);
+    self->reader_rc   = rc;
+    self->reader_done = true;
+    self->cv.notify_all();
+}
+
+Result CopyEngine::read_files() {
+    for (std::size_t i = 0; i < this->files.size(); ++i) {
+        auto &job = this->files[i];
+        if (job.size == 0)
+            continue;
+
+        File f;
+        R_TRY_RETURN(this->source_fs.open_file(f, job.source));
+        SCOPE_GUARD([&f] { f.close(); });
+
+        // The source may have changed since it was indexed
+        TRY_RETURNV(f.size() == job.size, err::SizeMismatch);
+
+        for (std::uint64_t offset = 0; offset < job.size;) {
+            std::size_t slot;
+            {
+                std::unique_lock lk(this->mutex);
+                this->cv.wait(lk, [this] { return this->aborted || (this->head - this->tail < nb_buffers); });
+                if (this->aborted)
+                    return err::CopyAborted;
+                slot = this->head % nb_buffers;
+            }
+
+            // The slot is owned by the reader until head is advanced
+            auto size = std::min<std::uint64_t>(buffer_size, job.size - offset);
+            TRY_RETURNV(f.read(this->buffers.get() + slot * buffer_size, size, offset) == size, err::ShortFsRead);
+
+            {
+                std::lock_guard lk(this->mutex);
+                this->chunks[slot] = { i, offset, size };
+                ++this->head;
+                this->cv.notify_all();
+            }
+
+            offset += size;
+        }
+    }
+
+    return Result::success();
+}
+
+Result CopyEngine::write_files(const ProgressCallback &progress) {
+    std::uint64_t done = 0;
+
+    for (std::size_t i = 0; i < this->files.size(); ++i) {
+        auto &job = this->files[i];
+        if (job.size == 0)
+            continue;
+
+        File f;
+        R_TRY_RETURN(this->dest_fs.open_file(f, job.destination, FsOpenMode_Write));
+        SCOPE_GUARD([&f] { f.close(); });
+
+        for (std::uint64_t written = 0; written < job.size;) {
+            std::size_t slot;
+            {
+                std::unique_lock lk(this->mutex);
+                this->cv.wait(lk, [this] { return this->reader_done || (this->head != this->tail); });
+                if (this->head == this->tail)
+                    return this->reader_rc.failed() ? this->reader_rc : err::CopyAborted;
+                slot = this->tail % nb_buffers;
+            }
+
+            auto &chunk = this->chunks[slot];
+            TRY_RETURNV(chunk.file == i && chunk.offset == written, err::CopyAborted);
+            R_TRY_RETURN(f.write(this->buffers.get() + slot * buffer_size, chunk.size, chunk.offset));
+            written += chunk.size, done += chunk.size;
+
+            {
+                std::lock_guard lk(this->mutex);
+                ++this->tail;
+                this->cv.notify_all();
+            }
+
+            if (progress)
+                progress(done, this->total_size);
+        }
+
+        TRY_RETURNV(f.size() == job.size, err::SizeMismatch);
+    }
+
+    return Result::success();
+}
+
+} // namespace nq::fs
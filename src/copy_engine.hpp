@@ -0,0 +1,76 @@
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <vector>
+#include <switch.h>
+
+#include "fs.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+// Copies a batch of files with reads and writes overlapped: a reader thread fills a ring of buffers
+// while the calling thread drains it. The ring spans file boundaries, so small files are pipelined too
+class CopyEngine {
+    NON_COPYABLE(CopyEngine);
+    NON_MOVEABLE(CopyEngine);
+
+    public:
+        constexpr static std::size_t buffer_size = 0x200000; // 2 MiB
+        constexpr static std::size_t nb_buffers  = 4;
+
+        using ProgressCallback = std::function<void(std::uint64_t done, std::uint64_t total)>;
+
+        CopyEngine(Filesystem &source_fs, Filesystem &dest_fs): source_fs(source_fs), dest_fs(dest_fs) { }
+
+        // Destination files must already exist with the right size
+        inline void add_file(std::string source, std::string destination, std::uint64_t size) {
+            this->files.push_back({ std::move(source), std::move(destination), size });
+            this->total_size += size;
+        }
+
+        inline std::uint64_t get_total_size() const {
+            return this->total_size;
+        }
+
+        Result run(const ProgressCallback &progress = {});
+
+    private:
+        struct Job {
+            std::string   source, destination;
+            std::uint64_t size;
+        };
+
+        struct Chunk {
+            std::size_t   file;
+            std::uint64_t offset;
+            std::size_t   size;
+        };
+
+        static void reader_func(void *args);
+        Result read_files();
+        Result write_files(const ProgressCallback &progress);
+
+    private:
+        Filesystem &source_fs, &dest_fs;
+
+        std::vector<Job> files;
+        std::uint64_t    total_size = 0;
+
+        std::unique_ptr<std::uint8_t[]> buffers;
+        Chunk                           chunks[nb_buffers] = {};
+
+        std::mutex              mutex;
+        std::condition_variable cv;
+        std::size_t             head = 0, tail = 0; // Next slot to fill/drain
+        bool                    reader_done = false, aborted = false;
+        Result                  reader_rc   = Result::success();
+};
+
+} // namespace nq::fs
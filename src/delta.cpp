@@ -0,0 +1,178 @@
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <new>
+
+#include "delta.hpp"
+#include "error.hpp"
+
+namespace nq::fs {
+
+namespace delta {
+
+std::uint32_t rolling_checksum(const void *data, std::size_t size) {
+    auto *bytes = static_cast<const std::uint8_t *>(data);
+
+    // Sums wrap modulo 2^32, which preserves their value modulo 2^16
+    std::uint32_t a = 0, b = 0;
+    for (std::size_t i = 0; i < size; ++i)
+        a += bytes[i], b += a;
+    return (a & 0xffff) | (b << 16);
+}
+
+Result compute_signatures(Filesystem &fs, const std::string &path, std::uint64_t size, std::uint32_t block_size,
+        ThreadPool *pool, std::vector<Signature> &signatures) {
+    auto nb_blocks = (size + block_size - 1) / block_size;
+    signatures.resize(nb_blocks);
+
+    // Jobs cover runs of blocks the size of a hasher chunk, each read in about a megabyte at a time
+    auto blocks_per_job  = std::max<std::uint64_t>(1, ContentHasher::chunk_size  / block_size);
+    auto blocks_per_read = std::max<std::uint64_t>(1, ContentHasher::read_size / block_size);
+    auto nb_jobs         = (nb_blocks + blocks_per_job - 1) / blocks_per_job;
+
+    std::mutex mutex;
+    Result rc = Result::success();
+    auto job = [&](std::size_t idx) {
+        auto fail = [&](Result job_rc) {
+            std::lock_guard lk(mutex);
+            rc = job_rc;
+        };
+
+        auto buf = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[blocks_per_read * block_size]);
+        if (!buf)
+            return fail(Result::failure());
+
+        File f;
+        if (auto open_rc = fs.open_file(f, path); open_rc.failed())
+            return fail(open_rc);
+        SCOPE_GUARD([&f] { f.close(); });
+
+        auto block = idx * blocks_per_job, end = std::min(block + blocks_per_job, nb_blocks);
+        while (block < end) {
+            auto offset    = block * block_size;
+            auto read_size = std::min<std::uint64_t>(std::min(blocks_per_read, end - block) * block_size, size - offset);
+            if (f.read(buf.get(), read_size, offset) != read_size)
+                return fail(err::ShortFsRead);
+
+            for (std::uint64_t pos = 0; pos < read_size; pos += block_size, ++block) {
+                auto len = std::min<std::uint64_t>(block_size, read_size - pos);
+
+                std::array<std::uint8_t, SHA256_HASH_SIZE> digest;
+                sha256CalculateHash(digest.data(), buf.get() + pos, len);
+                signatures[block].weak = rolling_checksum(buf.get() + pos, len);
+                std::copy_n(digest.begin(), signatures[block].strong.size(), signatures[block].strong.begin());
+            }
+        }
+    };
+
+    if (pool) {
+        pool->parallel_for(nb_jobs, job);
+    } else {
+        for (std::size_t i = 0; i < nb_jobs; ++i)
+            job(i);
+    }
+
+    return rc;
+}
+
+} // namespace delta
+
+void DeltaApplier::feed(const void *data, std::size_t size) {
+    auto *in = static_cast<const std::uint8_t *>(data);
+
+    while (size) {
+        if (this->literal_remaining) {
+            auto len = static_cast<std::size_t>(std::min<std::uint64_t>(this->literal_remaining, size));
+            this->write(in, len);
+            this->literal_remaining -= len, in += len, size -= len;
+            continue;
+        }
+
+        auto len = std::min(this->instruction.size() - this->instruction_fill, size);
+        std::copy_n(in, len, this->instruction.data() + this->instruction_fill);
+        this->instruction_fill += len, in += len, size -= len;
+
+        if (this->instruction_fill == this->instruction.size()) {
+            this->instruction_fill = 0;
+
+            delta::Instruction instruction;
+            std::memcpy(&instruction, this->instruction.data(), sizeof(instruction));
+            this->apply(instruction);
+        }
+    }
+}
+
+Result DeltaApplier::finish() {
+    if (this->instruction_fill || this->literal_remaining) {
+        ERROR("Delta stream was cut short\n");
+        this->fail(err::InvalidDelta);
+    }
+
+    if (this->offset != this->dest_size) {
+        ERROR("Delta output size mismatch (%#lx, expected %#lx)\n", this->offset, this->dest_size);
+        this->fail(err::SizeMismatch);
+    }
+
+    return this->rc;
+}
+
+void DeltaApplier::apply(const delta::Instruction &instruction) {
+    if (this->offset + instruction.length > this->dest_size) {
+        ERROR("Delta instruction overflows the output (%#lx + %#x)\n", this->offset, instruction.length);
+        this->fail(err::InvalidDelta);
+    }
+
+    switch (instruction.type) {
+        case delta::InstructionType::Literal:
+            // Skipped after a failure, but still consumed
+            this->literal_remaining = instruction.length;
+            break;
+        case delta::InstructionType::Copy: {
+                if ((instruction.offset > this->source_size) || (instruction.length > this->source_size - instruction.offset)) {
+                    ERROR("Delta copy out of the source (%#lx + %#x)\n", instruction.offset, instruction.length);
+                    this->fail(err::InvalidDelta);
+                }
+                if (this->rc.failed())
+                    break;
+
+                if (!this->copy_buffer) {
+                    this->copy_buffer.reset(new (std::nothrow) std::uint8_t[copy_buffer_size]);
+                    if (!this->copy_buffer) {
+                        this->fail(Result::failure());
+                        break;
+                    }
+                }
+
+                for (std::uint64_t done = 0; (done < instruction.length) && this->rc.succeeded();) {
+                    auto len = std::min<std::size_t>(copy_buffer_size, instruction.length - done);
+                    if (this->source.read(this->copy_buffer.get(), len, instruction.offset + done) != len) {
+                        this->fail(err::ShortFsRead);
+                        break;
+                    }
+                    this->write(this->copy_buffer.get(), len);
+                    done += len;
+                }
+            } break;
+        default:
+            // The stream can't be parsed any further
+            ERROR("Unknown delta instruction %#x\n", static_cast<std::uint32_t>(instruction.type));
+            this->fail(err::InvalidDelta);
+            break;
+    }
+}
+
+void DeltaApplier::write(const void *data, std::size_t size) {
+    if (this->rc.failed())
+        return;
+
+    if (auto rc = this->dest.write(data, size, this->offset); rc.failed()) {
+        this->fail(rc);
+        return;
+    }
+
+    if (this->hasher)
+        this->hasher->update(data, size);
+    this->offset += size;
+}
+
+} // namespace nq::fs
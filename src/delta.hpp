@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include <switch.h>
+
+#include "content_hasher.hpp"
+#include "fs.hpp"
+#include "thread_pool.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+// Rsync-style delta updates: the host gets block signatures of the old file, finds the blocks it shares with the
+// new one using the rolling checksum, and sends the new file as copies of old blocks and literal data
+namespace delta {
+
+constexpr inline std::uint32_t default_block_size = 0x10000;   // 64 KiB
+constexpr inline std::uint32_t min_block_size     = 0x200;
+constexpr inline std::uint32_t max_block_size     = 0x1000000; // 16 MiB
+constexpr inline std::size_t   max_blocks         = 0x100000;  // Larger blocks are used past this
+
+using StrongSum = std::array<std::uint8_t, 0x10>; // Truncated SHA-256
+
+struct Signature {
+    std::uint32_t weak;
+    StrongSum     strong;
+};
+ASSERT_SIZE(Signature, 0x14);
+ASSERT_STANDARD_LAYOUT(Signature);
+
+enum class InstructionType: std::uint32_t {
+    Copy    = 1, // Length bytes of the old file from offset
+    Literal = 2, // Length bytes following the instruction
+};
+
+struct Instruction {
+    InstructionType type;
+    std::uint32_t   length;
+    std::uint64_t   offset;
+};
+ASSERT_SIZE(Instruction, 0x10);
+ASSERT_STANDARD_LAYOUT(Instruction);
+
+// Rsync's weak checksum, a = sum(x[i]) and b = sum((n - i) * x[i]), both mod 2^16, combined as a | b << 16.
+// It can be rolled over a window one byte at a time, only the host needs to do that
+std::uint32_t rolling_checksum(const void *data, std::size_t size);
+
+// The last block may be short. Blocks are hashed concurrently when a pool is given
+Result compute_signatures(Filesystem &fs, const std::string &path, std::uint64_t size, std::uint32_t block_size,
+    ThreadPool *pool, std::vector<Signature> &signatures);
+
+} // namespace delta
+
+// Rebuilds a file from an old version and a stream of instructions fed in arbitrary chunks, as they arrive.
+// The output is written in order, and hashed along the way when a hasher is given
+class DeltaApplier {
+    NON_COPYABLE(DeltaApplier);
+    NON_MOVEABLE(DeltaApplier);
+
+    public:
+        constexpr static std::size_t copy_buffer_size = 0x100000; // 1 MiB
+
+        DeltaApplier(File &source, std::uint64_t source_size, File &dest, std::uint64_t dest_size,
+            StreamHasher *hasher = nullptr):
+            source(source), dest(dest), source_size(source_size), dest_size(dest_size), hasher(hasher) { }
+
+        // Instructions after a failure are parsed but not applied, so that the remainder of the stream is still
+        // consumed in sync
+        void feed(const void *data, std::size_t size);
+
+        // Fails if the stream was cut short, an instruction was invalid, or the output doesn't have the expected size
+        Result finish();
+
+    private:
+        void apply(const delta::Instruction &instruction);
+        void write(const void *data, std::size_t size);
+
+        inline void fail(Result rc) {
+            if (this->rc.succeeded())
+                this->rc = rc;
+        }
+
+    private:
+        File         &source, &dest;
+        std::uint64_t source_size, dest_size;
+        StreamHasher *hasher;
+
+        std::array<std::uint8_t, sizeof(delta::Instruction)> instruction;
+        std::size_t                                          instruction_fill = 0;
+        std::uint64_t                                        literal_remaining = 0;
+
+        std::unique_ptr<std::uint8_t[]> copy_buffer;
+        std::uint64_t                   offset = 0; // In the output
+        Result                          rc     = Result::success();
+};
+
+} // namespace nq::fs
@@ -11,6 +11,11 @@ constexpr static std::uint32_t module  = 0x99;
 constexpr static inline nq::Result FailedUsbXfer       = Result(module, 0);
 constexpr static inline nq::Result FailedUsbReceive    = Result(module, 1);
 constexpr static inline nq::Result FailedUsbSend       = Result(module, 2);
+constexpr static inline nq::Result ShortFsRead         = Result(module, 3);
+constexpr static inline nq::Result CopyAborted         = Result(module, 4);
+constexpr static inline nq::Result SizeMismatch        = Result(module, 5);
+constexpr static inline nq::Result InvalidDelta        = Result(module, 6);
+constexpr static inline nq::Result InvalidFrame        = Result(module, 7);
 
 constexpr static inline nq::Result KernelTimedOut      = Result(1, 117);
 constexpr static inline nq::Result FsPathAlreadyExists = Result(2, 2);
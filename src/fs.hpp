@@ -1,5 +1,6 @@
 #pragma once
 
+#include <algorithm>
 #include <cstdint>
 #include <string>
 #include <vector>
@@ -40,12 +41,29 @@ class Directory {
             return count;
         }
 
-        std::vector<FsDirectoryEntry> list() {
+        // Entries past what was actually read are trimmed, nothing is returned on failure
+        Result list(std::vector<FsDirectoryEntry> &entries) {
+            s64 count = 0, total = 0;
+            entries.clear();
+            R_TRY_RETURN(fsDirGetEntryCount(&this->handle, &count));
+            entries.resize(count);
+            if (Result rc = fsDirRead(&this->handle, &total, count, entries.data()); rc.failed()) {
+                entries.clear();
+                return rc;
+            }
+            entries.resize(std::min<s64>(total, count));
+            return Result::success();
+        }
+
+        // Appends up to count entries following the previous read, nb_read is 0 at the end of the listing
+        Result read(std::vector<FsDirectoryEntry> &entries, std::size_t count, std::size_t &nb_read) {
             s64 total = 0;
-            auto c = this->count();
-            auto entries = std::vector<FsDirectoryEntry>(c);
-            R_TRY_LOG(fsDirRead(&this->handle, &total, c, entries.data()));
-            return entries;
+            auto start = entries.size();
+            entries.resize(start + count);
+            Result rc = fsDirRead(&this->handle, &total, count, entries.data() + start);
+            nb_read = rc.succeeded() ? std::min<std::size_t>(total, count) : 0;
+            entries.resize(start + nb_read);
+            return rc;
         }
 
     protected:
@@ -91,8 +109,10 @@ class File {
             return tmp;
         }
 
-        inline void write(const void *buf, std::size_t size, std::size_t offset = 0) {
-            R_TRY_LOG(fsFileWrite(&this->handle, static_cast<s64>(offset), buf, size, FsWriteOption_None));
+        inline Result write(const void *buf, std::size_t size, std::size_t offset = 0) {
+            Result rc = fsFileWrite(&this->handle, static_cast<s64>(offset), buf, size, FsWriteOption_None);
+            R_TRY_LOG(rc);
+            return rc;
         }
 
         inline void flush() {
@@ -159,27 +179,6 @@ class Filesystem {
             return fsFsCreateFile(&this->handle, path.c_str(), static_cast<s64>(size), 0);
         }
 
-        inline Result copy_file(const std::string &source, const std::string &destination) {
-            File source_f, dest_f;
-            R_TRY_RETURN(this->open_file(source_f, source) || this->open_file(dest_f, destination, FsOpenMode_Write));
-
-            constexpr std::size_t buf_size = 0x100000; // 1 MiB
-            auto buf = std::vector<std::uint8_t>(buf_size);
-
-            std::size_t size = source_f.size(), offset = 0;
-            while (size) {
-                auto read = source_f.read(static_cast<void *>(buf.data()), buf_size, offset);
-                dest_f.write(buf.data(), read, offset);
-                offset += read;
-                size   -= read;
-            }
-
-            source_f.close();
-            dest_f.close();
-
-            return Result::success();
-        }
-
         inline FsDirEntryType get_path_type(const std::string &path) {
             FsDirEntryType type;
             R_TRY_LOG(fsFsGetEntryType(&this->handle, path.c_str(), &type));
@@ -0,0 +1,159 @@
+#include <algorithm>
+#include <array>
+#include <cstring>
+
+#include "lz4.hpp"
+
+namespace nq::lz4 {
+
+namespace {
+
+constexpr std::size_t min_match     = 4;
+constexpr std::size_t last_literals = 5;  // The block must end with literals
+constexpr std::size_t match_margin  = 12; // No match may start this close to the end
+constexpr std::size_t max_distance  = 0xffff;
+constexpr std::size_t hash_bits     = 12;
+
+inline std::uint32_t read32(const std::uint8_t *p) {
+    std::uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline std::uint32_t hash(std::uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - hash_bits);
+}
+
+// Lengths of 15 and over continue in extra bytes of 255, and a last byte for the remainder
+inline std::uint8_t *write_length(std::uint8_t *op, std::size_t len) {
+    for (; len >= 0xff; len -= 0xff)
+        *op++ = 0xff;
+    *op++ = static_cast<std::uint8_t>(len);
+    return op;
+}
+
+inline bool read_length(const std::uint8_t *&ip, const std::uint8_t *end, std::size_t &len) {
+    std::uint8_t b;
+    do {
+        if (ip == end)
+            return false;
+        b = *ip++, len += b;
+    } while (b == 0xff);
+    return true;
+}
+
+} // namespace
+
+std::size_t compress(const void *src, std::size_t src_size, void *dst, std::size_t dst_capacity) {
+    auto *in  = static_cast<const std::uint8_t *>(src);
+    auto *out = static_cast<std::uint8_t *>(dst), *op = out, *out_end = out + dst_capacity;
+
+    // Positions in the input of the last sequence of each hash
+    std::array<std::uint32_t, 1 << hash_bits> table = {};
+
+    auto emit = [&](std::size_t anchor, std::size_t literals, std::size_t offset, std::size_t match_len) {
+        // Token, extra lengths, literals and offset
+        auto size = 1 + literals / 0xff + 1 + literals + 2 + match_len / 0xff + 1;
+        if (size > static_cast<std::size_t>(out_end - op))
+            return false;
+
+        auto *token = op++;
+        *token = static_cast<std::uint8_t>(std::min<std::size_t>(literals, 0xf) << 4);
+        if (literals >= 0xf)
+            op = write_length(op, literals - 0xf);
+        std::memcpy(op, in + anchor, literals);
+        op += literals;
+
+        if (offset) {
+            *op++ = offset & 0xff, *op++ = offset >> 8;
+            match_len -= min_match;
+            *token |= std::min<std::size_t>(match_len, 0xf);
+            if (match_len >= 0xf)
+                op = write_length(op, match_len - 0xf);
+        }
+        return true;
+    };
+
+    std::size_t ip = 0, anchor = 0;
+    if (src_size > match_margin) {
+        auto match_limit = src_size - last_literals, ip_limit = src_size - match_margin;
+        while (ip < ip_limit) {
+            auto seq = read32(in + ip);
+            auto &slot = table[hash(seq)];
+            std::size_t ref = slot;
+            slot = ip;
+
+            if ((ref >= ip) || (ip - ref > max_distance) || (read32(in + ref) != seq)) {
+                // Skip faster through incompressible data
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while ((ip > anchor) && (ref > 0) && (in[ip - 1] == in[ref - 1]))
+                --ip, --ref;
+
+            auto len = min_match;
+            while ((ip + len < match_limit) && (in[ip + len] == in[ref + len]))
+                ++len;
+
+            if (!emit(anchor, ip - anchor, ip - ref, len))
+                return 0;
+            ip += len, anchor = ip;
+        }
+    }
+
+    if (!emit(anchor, src_size - anchor, 0, 0))
+        return 0;
+    return op - out;
+}
+
+bool decompress(const void *src, std::size_t src_size, void *dst, std::size_t dst_size) {
+    auto *ip  = static_cast<const std::uint8_t *>(src), *in_end = ip + src_size;
+    auto *out = static_cast<std::uint8_t *>(dst), *op = out, *out_end = out + dst_size;
+
+    while (true) {
+        if (ip == in_end)
+            return false;
+        auto token = *ip++;
+
+        std::size_t literals = token >> 4;
+        if ((literals == 0xf) && !read_length(ip, in_end, literals))
+            return false;
+        if ((literals > static_cast<std::size_t>(in_end - ip)) || (literals > static_cast<std::size_t>(out_end - op)))
+            return false;
+        std::memcpy(op, ip, literals);
+        ip += literals, op += literals;
+
+        // The last sequence has no match
+        if (ip == in_end)
+            break;
+
+        if (in_end - ip < 2)
+            return false;
+        std::size_t offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if ((offset == 0) || (offset > static_cast<std::size_t>(op - out)))
+            return false;
+
+        std::size_t match_len = token & 0xf;
+        if ((match_len == 0xf) && !read_length(ip, in_end, match_len))
+            return false;
+        match_len += min_match;
+        if (match_len > static_cast<std::size_t>(out_end - op))
+            return false;
+
+        // Overlapping matches repeat the last offset bytes, and must be copied forward
+        auto *ref = op - offset;
+        if (offset >= match_len) {
+            std::memcpy(op, ref, match_len);
+            op += match_len;
+        } else {
+            for (std::size_t i = 0; i < match_len; ++i)
+                *op++ = *ref++;
+        }
+    }
+
+    return op == out_end;
+}
+
+} // namespace nq::lz4
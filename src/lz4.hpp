@@ -0,0 +1,21 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+namespace nq::lz4 {
+
+// Blocks are in the standard LZ4 block format, so hosts can use the reference library to handle them
+
+// Largest compressed size of an input of the given size
+constexpr inline std::size_t compress_bound(std::size_t size) {
+    return size + size / 255 + 16;
+}
+
+// Returns the compressed size, or 0 if the result doesn't fit the destination
+std::size_t compress(const void *src, std::size_t src_size, void *dst, std::size_t dst_capacity);
+
+// Fails unless the block decompresses to exactly dst_size bytes
+bool decompress(const void *src, std::size_t src_size, void *dst, std::size_t dst_size);
+
+} // namespace nq::lz4
@@ -4,9 +4,15 @@
 #include "error.hpp"
 #include "mtp_storage.hpp"
 #include "mtp_server.hpp"
+#include "mtp_thumbnails.hpp"
 #include "usb.hpp"
 #include "utils.hpp"
 
+// One fs session per enumeration worker plus the server thread, so that concurrent listings aren't serialized
+extern "C" {
+    u32 __nx_fs_num_sessions = nq::mtp::StorageManager::enumeration_workers + 1;
+}
+
 extern "C" void userAppInit() {
     nq::log::initialize();
 }
@@ -48,6 +54,7 @@ int main(int argc, char **argv) {
     INFO("Starting\n");
 
     R_TRY_LOG(nq::usb::initialize());
+    R_TRY_LOG(nq::mtp::thumbs::initialize());
 
     auto sd_storage = nq::mtp::Storage(
         nq::fs::Filesystem::sdmc(),
@@ -94,6 +101,8 @@ int main(int argc, char **argv) {
     );
 
     nq::mtp::StorageManager man;
+    man.set_index_location(nq::fs::Filesystem::sdmc(), "/switch/Nuqe");
+    man.set_transfer_hashing(true);
     man.add_storage(std::move(sd_storage));
     man.add_storage(std::move(user_storage));
     man.add_storage(std::move(system_storage));
@@ -117,8 +126,11 @@ int main(int argc, char **argv) {
 
     INFO("Exiting\n");
     nq::usb::finalize();
+    nq::mtp::thumbs::finalize();
     exit_thread.join();
 
+    man.save_indices();
+
 #ifndef DEBUG
     consoleExit(nullptr);
 #endif
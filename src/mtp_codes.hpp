@@ -73,6 +73,21 @@ enum class OperationCode: TransactionCode {
     SetObjectPropList                           = 0x9806,
     GetInterdependentPropDesc                   = 0x9807,
     SendObjectPropList                          = 0x9808,
+
+    // Vendor extensions, advertised as "nuqe" in the device info
+    GetObjectInfoList                           = 0x9601,
+    GetObjectTree                               = 0x9602,
+    GetObjectChanges                            = 0x9603,
+    SearchObjects                               = 0x9604,
+    GetSearchResults                            = 0x9605,
+    GetObjectHandlesPaged                       = 0x9606,
+    GetObjectArchive                            = 0x9607,
+    SendObjectArchive                           = 0x9608,
+    GetObjectSignatures                         = 0x9609,
+    SendObjectDelta                             = 0x960a,
+    GetObjectCompressed                         = 0x960b,
+    SendObjectCompressed                        = 0x960c,
+    GetCommitStats                              = 0x960d,
 };
 
 enum class ResponseCode: TransactionCode {
@@ -408,6 +423,10 @@ enum class ObjectPropertyCode: std::uint16_t {
     Last_Build_Date                             = 0xdd70,
     Time_to_Live                                = 0xdd71,
     Media_GUID                                  = 0xdd72,
+
+    // Vendor extensions (0xd800-0xdbff)
+    Content_CRC32                               = 0xd801,
+    Content_Hash                                = 0xd802,
 };
 
 enum class DevicePropertyCode: std::uint16_t {
@@ -0,0 +1,146 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#include "mtp_codes.hpp"
+#include "mtp_types.hpp"
+
+namespace nq::mtp::formats {
+
+// Formats files get classified as, besides Undefined and Association
+constexpr inline std::array detected = {
+    ObjectFormatCode::Executable,
+    ObjectFormatCode::Text,
+    ObjectFormatCode::HTML,
+    ObjectFormatCode::AIFF,
+    ObjectFormatCode::WAV,
+    ObjectFormatCode::MP3,
+    ObjectFormatCode::AVI,
+    ObjectFormatCode::MPEG,
+    ObjectFormatCode::ASF,
+    ObjectFormatCode::EXIF_JPEG,
+    ObjectFormatCode::BMP,
+    ObjectFormatCode::GIF,
+    ObjectFormatCode::PNG,
+    ObjectFormatCode::TIFF,
+    ObjectFormatCode::JP2,
+    ObjectFormatCode::WMA,
+    ObjectFormatCode::OGG,
+    ObjectFormatCode::AAC,
+    ObjectFormatCode::FLAC,
+    ObjectFormatCode::WMV,
+    ObjectFormatCode::MP4_Container,
+    ObjectFormatCode::_3GP_Container,
+    ObjectFormatCode::M3U_Playlist,
+    ObjectFormatCode::PLS_Playlist,
+    ObjectFormatCode::XML_Document,
+};
+
+// Number of leading bytes needed by from_magic
+constexpr inline std::size_t magic_size = 0x20;
+
+// Only formats that identify a minority of files are worth a lookup table
+constexpr inline bool is_indexed(ObjectFormatCode format) {
+    return (format != ObjectFormatCode::Undefined) && (format != ObjectFormatCode::Association);
+}
+
+static inline ObjectFormatCode from_extension(std::string_view name) {
+    struct Extension {
+        std::string_view ext;
+        ObjectFormatCode format;
+    };
+
+    constexpr static std::array extensions = {
+        Extension{ "jpg",  ObjectFormatCode::EXIF_JPEG      },
+        Extension{ "jpeg", ObjectFormatCode::EXIF_JPEG      },
+        Extension{ "png",  ObjectFormatCode::PNG            },
+        Extension{ "gif",  ObjectFormatCode::GIF            },
+        Extension{ "bmp",  ObjectFormatCode::BMP            },
+        Extension{ "tif",  ObjectFormatCode::TIFF           },
+        Extension{ "tiff", ObjectFormatCode::TIFF           },
+        Extension{ "jp2",  ObjectFormatCode::JP2            },
+        Extension{ "mp4",  ObjectFormatCode::MP4_Container  },
+        Extension{ "m4v",  ObjectFormatCode::MP4_Container  },
+        Extension{ "3gp",  ObjectFormatCode::_3GP_Container },
+        Extension{ "avi",  ObjectFormatCode::AVI            },
+        Extension{ "mpg",  ObjectFormatCode::MPEG           },
+        Extension{ "mpeg", ObjectFormatCode::MPEG           },
+        Extension{ "asf",  ObjectFormatCode::ASF            },
+        Extension{ "wmv",  ObjectFormatCode::WMV            },
+        Extension{ "mp3",  ObjectFormatCode::MP3            },
+        Extension{ "wav",  ObjectFormatCode::WAV            },
+        Extension{ "aif",  ObjectFormatCode::AIFF           },
+        Extension{ "aiff", ObjectFormatCode::AIFF           },
+        Extension{ "ogg",  ObjectFormatCode::OGG            },
+        Extension{ "aac",  ObjectFormatCode::AAC            },
+        Extension{ "m4a",  ObjectFormatCode::AAC            },
+        Extension{ "flac", ObjectFormatCode::FLAC           },
+        Extension{ "wma",  ObjectFormatCode::WMA            },
+        Extension{ "m3u",  ObjectFormatCode::M3U_Playlist   },
+        Extension{ "pls",  ObjectFormatCode::PLS_Playlist   },
+        Extension{ "txt",  ObjectFormatCode::Text           },
+        Extension{ "log",  ObjectFormatCode::Text           },
+        Extension{ "ini",  ObjectFormatCode::Text           },
+        Extension{ "htm",  ObjectFormatCode::HTML           },
+        Extension{ "html", ObjectFormatCode::HTML           },
+        Extension{ "xml",  ObjectFormatCode::XML_Document   },
+        Extension{ "nro",  ObjectFormatCode::Executable     },
+        Extension{ "nso",  ObjectFormatCode::Executable     },
+    };
+
+    auto pos = name.rfind('.');
+    if ((pos == std::string_view::npos) || (name.size() - pos - 1 > 4))
+        return ObjectFormatCode::Undefined;
+
+    // Extensions are compared case-insensitively
+    char ext[4] = {};
+    auto len = name.size() - pos - 1;
+    std::transform(name.begin() + pos + 1, name.end(), ext, [](char c) {
+        return (('A' <= c) && (c <= 'Z')) ? c - 'A' + 'a' : c;
+    });
+
+    for (auto &&e: extensions)
+        if (e.ext == std::string_view(ext, len))
+            return e.format;
+    return ObjectFormatCode::Undefined;
+}
+
+static inline ObjectFormatCode from_magic(const std::uint8_t *data, std::size_t size) {
+    auto matches = [data, size](std::size_t offset, std::string_view magic) {
+        return (offset + magic.size() <= size) && !std::memcmp(data + offset, magic.data(), magic.size());
+    };
+
+    if (matches(0, "\xff\xd8\xff"))
+        return ObjectFormatCode::EXIF_JPEG;
+    if (matches(0, "\x89PNG"))
+        return ObjectFormatCode::PNG;
+    if (matches(0, "GIF8"))
+        return ObjectFormatCode::GIF;
+    if (matches(0, "BM"))
+        return ObjectFormatCode::BMP;
+    if (matches(0, std::string_view("II*\0", 4)) || matches(0, std::string_view("MM\0*", 4)))
+        return ObjectFormatCode::TIFF;
+    if (matches(0, "RIFF") && matches(8, "WAVE"))
+        return ObjectFormatCode::WAV;
+    if (matches(0, "RIFF") && matches(8, "AVI "))
+        return ObjectFormatCode::AVI;
+    if (matches(0, "ID3"))
+        return ObjectFormatCode::MP3;
+    if (matches(0, "OggS"))
+        return ObjectFormatCode::OGG;
+    if (matches(0, "fLaC"))
+        return ObjectFormatCode::FLAC;
+    if (matches(4, "ftyp3g"))
+        return ObjectFormatCode::_3GP_Container;
+    if (matches(4, "ftyp"))
+        return ObjectFormatCode::MP4_Container;
+    if (matches(0x10, "NRO0") || matches(0, "NSO0"))
+        return ObjectFormatCode::Executable;
+    return ObjectFormatCode::Undefined;
+}
+
+} // namespace nq::mtp::formats
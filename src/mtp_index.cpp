@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <array>
+
+#include "mtp_formats.hpp"
+#include "mtp_object.hpp"
+#include "mtp_storage.hpp"
+
+namespace nq::mtp {
+
+// Binary snapshot of a storage index, written to the sd card on exit so handles and
+// cached metadata survive reconnections. Entries are ordered so that parents always
+// precede their children, each entry is immediately followed by its utf-8 name.
+// Content ids of hashed files come last
+constexpr static std::uint32_t index_magic   = 0x5849514e; // "NQIX"
+constexpr static std::uint16_t index_version = 5;
+
+struct IndexHeader {
+    std::uint32_t magic       = index_magic;
+    std::uint16_t version     = index_version;
+    std::uint16_t reserved    = 0;
+    std::uint32_t storage_id  = 0;
+    std::uint32_t next_handle = 0; // Size of the handle table
+    std::uint32_t nb_objects  = 0;
+    std::uint32_t nb_ids      = 0;
+};
+ASSERT_SIZE(IndexHeader, 0x18);
+ASSERT_STANDARD_LAYOUT(IndexHeader);
+
+struct IndexEntry {
+    std::uint64_t    size      = 0;
+    std::uint64_t    stamp     = 0;
+    Object::Handle   handle    = 0;
+    Object::Handle   parent    = 0;
+    ObjectFormatCode format    = ObjectFormatCode::Undefined;
+    std::uint16_t    name_size = 0;
+    std::uint32_t    reserved  = 0;
+};
+ASSERT_SIZE(IndexEntry, 0x20);
+ASSERT_STANDARD_LAYOUT(IndexEntry);
+
+struct IndexContentId {
+    Object::Handle               handle   = 0;
+    std::uint32_t                modified = 0;
+    std::uint64_t                size     = 0;
+    std::array<std::uint8_t, 16> id       = {};
+    std::uint32_t                crc32    = 0;
+    std::uint32_t                reserved = 0;
+};
+ASSERT_SIZE(IndexContentId, 0x28);
+ASSERT_STANDARD_LAYOUT(IndexContentId);
+
+Result Storage::load_index(fs::Filesystem &fs, const std::string &path) {
+    // Even if no snapshot could be used, a fresh one should be written on exit
+    this->index_loaded = true;
+
+    // A save interrupted while swapping files leaves the previous snapshot aside
+    fs::File f;
+    if (fs.open_file(f, path).failed())
+        R_TRY_RETURN(fs.open_file(f, path + ".old"));
+    SCOPE_GUARD([&f] { f.close(); });
+
+    auto buf = std::vector<std::uint8_t>(f.size());
+    TRY_RETURNV(buf.size() >= sizeof(IndexHeader), Result::failure());
+    TRY_RETURNV(f.read(buf.data(), buf.size()) == buf.size(), Result::failure());
+
+    auto *header = reinterpret_cast<const IndexHeader *>(buf.data());
+    TRY_RETURNV(header->magic == index_magic && header->version == index_version, Result::failure());
+    TRY_RETURNV(header->storage_id == this->id.id, Result::failure());
+    TRY_RETURNV(header->next_handle <= handle_local_mask + 1, Result::failure());
+
+    // The whole snapshot is checked before anything is restored, so that a damaged one leaves the index untouched
+    std::size_t offset = sizeof(IndexHeader);
+    for (std::uint32_t i = 0; i < header->nb_objects; ++i) {
+        TRY_RETURNV(offset + sizeof(IndexEntry) <= buf.size(), Result::failure());
+        offset += sizeof(IndexEntry) + reinterpret_cast<const IndexEntry *>(buf.data() + offset)->name_size;
+        TRY_RETURNV(offset <= buf.size(), Result::failure());
+    }
+    TRY_RETURNV(offset + std::uint64_t(header->nb_ids) * sizeof(IndexContentId) <= buf.size(), Result::failure());
+
+    // Restore the handle table layout so that handles of unlisted objects are never reused
+    this->handles.resize(std::max<std::size_t>(this->handles.size(), header->next_handle), Object::invalid_index);
+
+    offset = sizeof(IndexHeader);
+    for (std::uint32_t i = 0; i < header->nb_objects; ++i) {
+        auto *entry = reinterpret_cast<const IndexEntry *>(buf.data() + offset);
+        auto name   = std::string_view(reinterpret_cast<const char *>(buf.data() + offset + sizeof(IndexEntry)),
+            entry->name_size);
+        offset += sizeof(IndexEntry) + entry->name_size;
+
+        if (entry->handle == root_handle) {
+            this->directories[0].stamp = entry->stamp;
+            continue;
+        }
+
+        // Parents are always written first, anything else means the snapshot is damaged. Dropped entries
+        // must be found again by listing their parent, whose stamp would otherwise match
+        auto *parent = this->find_handle(entry->parent);
+        if (!parent || !parent->is_directory())
+            continue;
+
+        auto local = entry->handle & handle_local_mask;
+        if (((entry->handle & ~handle_local_mask) != this->handle_prefix) || (local == 0) ||
+                (local >= this->handles.size()) || (this->handles[local] != Object::invalid_index)) {
+            this->get_directory(*parent).stamp = 0;
+            continue;
+        }
+
+        // Timestamps aren't restored, listings don't catch same-size edits made outside the session
+        auto idx = this->objects.allocate();
+        auto &obj    = this->objects[idx];
+        obj.handle   = entry->handle;
+        obj.format   = entry->format;
+        obj.size     = entry->size;
+        obj.parent   = this->index_of(*parent);
+        this->set_name(obj, name);
+        this->handles[local] = idx;
+
+        if (obj.is_directory())
+            this->directories[idx].stamp = entry->stamp;
+        this->directories[obj.parent].children.push_back(idx);
+
+        if (formats::is_indexed(obj.format))
+            this->format_index[obj.format].insert(idx);
+    }
+
+    // Files are checked against the filesystem before their ids are served
+    for (std::uint32_t i = 0; i < header->nb_ids; ++i) {
+        auto *entry = reinterpret_cast<const IndexContentId *>(buf.data() + offset);
+        offset += sizeof(IndexContentId);
+
+        if (auto *obj = this->find_handle(entry->handle); obj && obj->is_file() && (obj->size == entry->size))
+            this->content_ids[entry->handle] = { entry->size, entry->modified, false, entry->id, entry->crc32 };
+    }
+
+    INFO("Loaded %u objects from index %s\n", header->nb_objects, path.c_str());
+    return Result::success();
+}
+
+Result Storage::save_index(fs::Filesystem &fs, const std::string &path) {
+    auto tmp_path = path + ".tmp";
+    fs.delete_file(tmp_path);
+    R_TRY_RETURN(fs.create_file(tmp_path));
+
+    fs::File f;
+    R_TRY_RETURN(fs.open_file(f, tmp_path, FsOpenMode_Write | FsOpenMode_Append));
+
+    constexpr std::size_t buf_size = 0x100000; // 1 MiB
+    std::vector<std::uint8_t> buf;
+    buf.reserve(buf_size + sizeof(IndexEntry) + FS_MAX_PATH);
+
+    // Writing stops at the first failure, which is reported once the file is complete
+    std::size_t offset = 0;
+    auto rc = Result::success();
+    auto flush = [&] {
+        if (rc.succeeded())
+            rc = f.write(buf.data(), buf.size(), offset);
+        offset += buf.size();
+        buf.clear();
+    };
+
+    auto append = [&buf](const void *data, std::size_t size) {
+        std::copy_n(static_cast<const std::uint8_t *>(data), size, std::back_inserter(buf));
+    };
+
+    IndexHeader header;
+    header.storage_id  = this->id.id;
+    header.next_handle = this->handles.size();
+    header.nb_objects  = this->objects.size();
+    header.nb_ids      = this->content_ids.size();
+    append(&header, sizeof(header));
+
+    // Breadth-first walk from the root, which guarantees parents are written before their children
+    std::vector<Object::Index> queue = { 0 };
+    for (std::size_t i = 0; i < queue.size(); ++i) {
+        auto &obj = this->objects[queue[i]];
+        auto name = this->get_name(obj);
+
+        IndexEntry entry;
+        entry.size      = obj.size;
+        entry.handle    = obj.handle;
+        entry.parent    = this->get_parent_handle(obj);
+        entry.format    = obj.format;
+        entry.name_size = name.size();
+
+        if (auto it = this->directories.find(queue[i]); it != this->directories.end()) {
+            entry.stamp = it->second.stamp;
+            queue.insert(queue.end(), it->second.children.begin(), it->second.children.end());
+        }
+
+        append(&entry, sizeof(entry));
+        append(name.data(), name.size());
+
+        if (buf.size() >= buf_size)
+            flush();
+    }
+
+    for (auto &&[handle, cid]: this->content_ids) {
+        IndexContentId entry;
+        entry.handle   = handle;
+        entry.modified = cid.modified;
+        entry.size     = cid.size;
+        entry.id       = cid.id;
+        entry.crc32    = cid.crc32;
+        append(&entry, sizeof(entry));
+
+        if (buf.size() >= buf_size)
+            flush();
+    }
+    flush();
+    f.close();
+
+    if (rc.failed()) {
+        ERROR("Failed to write index %s: %#x\n", tmp_path.c_str(), rc.code());
+        fs.delete_file(tmp_path);
+        return rc;
+    }
+
+    // The previous snapshot is only dropped once the new one is in place
+    auto old_path = path + ".old";
+    fs.delete_file(old_path);
+    bool had_old = fs.move_file(path, old_path).succeeded();
+    if (rc = fs.move_file(tmp_path, path); rc.failed()) {
+        if (had_old)
+            fs.move_file(old_path, path);
+        fs.delete_file(tmp_path);
+        return rc;
+    }
+    fs.delete_file(old_path);
+
+    INFO("Saved %zu objects to index %s\n", queue.size(), path.c_str());
+    return Result::success();
+}
+
+} // namespace nq::mtp
@@ -0,0 +1,207 @@
+#include <algorithm>
+#include <cstring>
+#include <string_view>
+
+#include "mtp_media.hpp"
+
+namespace nq::mtp::media {
+
+static inline std::uint16_t read_be16(const std::uint8_t *p) {
+    return (p[0] << 8) | p[1];
+}
+
+static inline std::uint32_t read_be32(const std::uint8_t *p) {
+    return (read_be16(p) << 16) | read_be16(p + 2);
+}
+
+static inline std::uint64_t read_be64(const std::uint8_t *p) {
+    return (static_cast<std::uint64_t>(read_be32(p)) << 32) | read_be32(p + 4);
+}
+
+static inline std::uint16_t read_le16(const std::uint8_t *p) {
+    return (p[1] << 8) | p[0];
+}
+
+static inline std::uint32_t read_le32(const std::uint8_t *p) {
+    return (read_le16(p + 2) << 16) | read_le16(p);
+}
+
+static bool parse_png(fs::File &file, MediaInfo &info) {
+    std::uint8_t buf[0x1a];
+    if ((file.read(buf, sizeof(buf)) != sizeof(buf)) || std::memcmp(buf, "\x89PNG", 4) || std::memcmp(buf + 12, "IHDR", 4))
+        return false;
+
+    // Samples per pixel, by color type
+    constexpr std::uint8_t channels[] = { 1, 0, 3, 1, 2, 0, 4 };
+    info.width  = read_be32(buf + 16);
+    info.height = read_be32(buf + 20);
+    info.depth  = (buf[25] < sizeof(channels)) ? buf[24] * channels[buf[25]] : 0;
+    return true;
+}
+
+static bool parse_gif(fs::File &file, MediaInfo &info) {
+    std::uint8_t buf[0xb];
+    if ((file.read(buf, sizeof(buf)) != sizeof(buf)) || std::memcmp(buf, "GIF8", 4))
+        return false;
+
+    info.width  = read_le16(buf + 6);
+    info.height = read_le16(buf + 8);
+    info.depth  = ((buf[10] >> 4) & 7) + 1; // Color resolution
+    return true;
+}
+
+static bool parse_bmp(fs::File &file, MediaInfo &info) {
+    std::uint8_t buf[0x1e];
+    if ((file.read(buf, sizeof(buf)) != sizeof(buf)) || std::memcmp(buf, "BM", 2))
+        return false;
+
+    // OS/2 core headers use 16-bit dimensions, later ones signed 32-bit (negative heights for top-down bitmaps)
+    if (read_le32(buf + 14) == 12) {
+        info.width  = read_le16(buf + 18);
+        info.height = read_le16(buf + 20);
+        info.depth  = read_le16(buf + 24);
+    } else {
+        auto height = static_cast<std::int32_t>(read_le32(buf + 22));
+        info.width  = read_le32(buf + 18);
+        info.height = (height < 0) ? -height : height;
+        info.depth  = read_le16(buf + 28);
+    }
+    return true;
+}
+
+static bool parse_jpeg(fs::File &file, std::uint64_t size, MediaInfo &info) {
+    // Bounds the number of reads on damaged files
+    constexpr std::size_t max_segments = 0x40;
+
+    std::uint8_t buf[0xa];
+    if ((file.read(buf, 2) != 2) || (buf[0] != 0xff) || (buf[1] != 0xd8))
+        return false;
+
+    std::uint64_t pos = 2;
+    for (std::size_t i = 0; (i < max_segments) && (pos + sizeof(buf) <= size); ++i) {
+        if ((file.read(buf, sizeof(buf), pos) != sizeof(buf)) || (buf[0] != 0xff))
+            return false;
+
+        // Markers may be preceded by fill bytes
+        auto marker = buf[1];
+        if (marker == 0xff) {
+            ++pos;
+            continue;
+        }
+
+        // Start of scan or end of image, the frame header should have come first
+        if ((marker == 0xda) || (marker == 0xd9))
+            return false;
+
+        // SOF0-15, except DHT, JPG and DAC which share the range
+        if ((marker >= 0xc0) && (marker <= 0xcf) && (marker != 0xc4) && (marker != 0xc8) && (marker != 0xcc)) {
+            info.height = read_be16(buf + 5);
+            info.width  = read_be16(buf + 7);
+            info.depth  = buf[4] * buf[9];
+            return true;
+        }
+
+        pos += 2 + read_be16(buf + 2);
+    }
+    return false;
+}
+
+// Calls back with the type, payload offset and payload size of each box in [begin, end), until it returns true
+template <typename F>
+static bool for_each_box(fs::File &file, std::uint64_t begin, std::uint64_t end, F &&callback) {
+    std::uint8_t buf[0x10];
+    for (auto pos = begin; pos + 8 <= end;) {
+        if (file.read(buf, 8, pos) != 8)
+            return false;
+
+        std::uint64_t box_size = read_be32(buf), header_size = 8;
+        if (box_size == 1) {
+            // 64-bit size follows the type
+            if (file.read(buf + 8, 8, pos + 8) != 8)
+                return false;
+            box_size = read_be64(buf + 8), header_size = 16;
+        } else if (box_size == 0) {
+            // Box extends to the end of the container
+            box_size = end - pos;
+        }
+
+        // 64-bit sizes are untrusted, pos + box_size could wrap
+        if ((box_size < header_size) || (box_size > end - pos))
+            return false;
+
+        if (callback(std::string_view(reinterpret_cast<const char *>(buf + 4), 4), pos + header_size, box_size - header_size))
+            return true;
+        pos += box_size;
+    }
+    return false;
+}
+
+static bool parse_mp4(fs::File &file, std::uint64_t size, MediaInfo &info) {
+    auto parse_mvhd = [&](std::uint64_t offset, std::uint64_t payload_size) {
+        std::uint8_t buf[0x20];
+        if ((payload_size < sizeof(buf)) || (file.read(buf, sizeof(buf), offset) != sizeof(buf)))
+            return;
+
+        // Version 1 uses 64-bit times and durations
+        std::uint32_t timescale; std::uint64_t duration;
+        if (buf[0] == 1)
+            timescale = read_be32(buf + 20), duration = read_be64(buf + 24);
+        else
+            timescale = read_be32(buf + 12), duration = read_be32(buf + 16);
+
+        if (timescale)
+            info.duration = duration * 1000 / timescale;
+    };
+
+    auto parse_tkhd = [&](std::uint64_t offset, std::uint64_t payload_size) {
+        // Dimensions are the last two fields, as 16.16 fixed point. Audio tracks have them zeroed
+        std::uint8_t buf[8];
+        if ((payload_size < 0x54) || (file.read(buf, sizeof(buf), offset + payload_size - sizeof(buf)) != sizeof(buf)))
+            return;
+        if (info.width == 0) {
+            info.width  = read_be32(buf)     >> 16;
+            info.height = read_be32(buf + 4) >> 16;
+        }
+    };
+
+    return for_each_box(file, 0, size, [&](std::string_view type, std::uint64_t offset, std::uint64_t payload_size) {
+        if (type != "moov")
+            return false;
+
+        for_each_box(file, offset, offset + payload_size, [&](std::string_view type, std::uint64_t offset, std::uint64_t payload_size) {
+            if (type == "mvhd") {
+                parse_mvhd(offset, payload_size);
+            } else if (type == "trak") {
+                for_each_box(file, offset, offset + payload_size, [&](std::string_view type, std::uint64_t offset, std::uint64_t payload_size) {
+                    if (type != "tkhd")
+                        return false;
+                    parse_tkhd(offset, payload_size);
+                    return true;
+                });
+            }
+            return false;
+        });
+        return true;
+    });
+}
+
+bool parse(fs::File &file, std::uint64_t size, ObjectFormatCode format, MediaInfo &info) {
+    switch (format) {
+        case ObjectFormatCode::EXIF_JPEG:
+        case ObjectFormatCode::JFIF:
+            return parse_jpeg(file, size, info);
+        case ObjectFormatCode::PNG:
+            return parse_png(file, info);
+        case ObjectFormatCode::GIF:
+            return parse_gif(file, info);
+        case ObjectFormatCode::BMP:
+            return parse_bmp(file, info);
+        case ObjectFormatCode::MP4_Container:
+        case ObjectFormatCode::_3GP_Container:
+            return parse_mp4(file, size, info);
+        default:
+            return false;
+    }
+}
+
+} // namespace nq::mtp::media
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstdint>
+
+#include "mtp_codes.hpp"
+#include "fs.hpp"
+
+namespace nq::mtp::media {
+
+// Metadata parsed from file headers, zeroed fields are unknown
+struct MediaInfo {
+    std::uint32_t width    = 0;
+    std::uint32_t height   = 0;
+    std::uint32_t depth    = 0; // Bits per pixel
+    std::uint32_t duration = 0; // Milliseconds
+};
+
+constexpr inline bool has_duration(ObjectFormatCode format) {
+    return (format == ObjectFormatCode::MP4_Container) || (format == ObjectFormatCode::_3GP_Container);
+}
+
+constexpr inline bool is_supported(ObjectFormatCode format) {
+    switch (format) {
+        case ObjectFormatCode::EXIF_JPEG:
+        case ObjectFormatCode::JFIF:
+        case ObjectFormatCode::PNG:
+        case ObjectFormatCode::GIF:
+        case ObjectFormatCode::BMP:
+            return true;
+        default:
+            return has_duration(format);
+    }
+}
+
+// Only reads headers, a handful of small reads per file
+bool parse(fs::File &file, std::uint64_t size, ObjectFormatCode format, MediaInfo &info);
+
+} // namespace nq::mtp::media
@@ -1,41 +1,32 @@
 #pragma once
 
 #include <cstdint>
-#include <string>
+#include <memory>
+#include <vector>
+#include <switch.h>
 
 #include "mtp_codes.hpp"
 #include "mtp_types.hpp"
+#include "utils.hpp"
 
 namespace nq::mtp {
 
-struct ObjectInfo;
-
+// Index entry. Names live in the string arena of the owning storage, and paths are
+// rebuilt from the parent chain when needed (see Storage::get_path)
 struct Object {
     using Handle = std::uint32_t;
+    using Index  = std::uint32_t;
 
-    static inline Handle s_handle = 0;
-
-    ObjectFormatCode format = ObjectFormatCode::Undefined;
-    std::size_t      size   = 0;
-    String           name   = {};
-    std::string      path   = {};
-    Handle           handle = s_handle;
-    Object          *parent = nullptr;
-
-    static inline Handle new_handle() {
-        return (++s_handle == 0) ? 1 : s_handle;
-    }
-
-    static String name_from_path(const std::string &path) {
-        return path.substr(path.find_last_of("/") + 1);
-    }
-
-    inline Object() = default;
-    inline Object(const FsDirectoryEntry &entry, std::string &&path, Object *parent):
-        format(type(entry)), size(entry.file_size), name(entry.name),
-        path(std::move(path)), parent(parent) { }
+    constexpr static Index invalid_index = 0xffffffff;
 
-    Object(const ObjectInfo &info, std::string &&path, Object &parent);
+    std::uint64_t    size      = 0;
+    std::uint32_t    created   = 0; // Cached POSIX timestamps, 0 until queried
+    std::uint32_t    modified  = 0;
+    Handle           handle    = 0; // 0 for free arena slots
+    Index            parent    = invalid_index;
+    std::uint32_t    name      = 0; // Offset into the name arena
+    std::uint16_t    name_size = 0;
+    ObjectFormatCode format    = ObjectFormatCode::Undefined;
 
     static constexpr inline ObjectFormatCode type(const FsDirectoryEntry &entry) {
         return (entry.type == FsDirEntryType_Dir) ? ObjectFormatCode::Association : ObjectFormatCode::Undefined;
@@ -48,6 +39,70 @@ struct Object {
     inline constexpr bool is_file() const {
         return !this->is_directory();
     }
+
+    inline constexpr bool has_timestamps() const {
+        return this->modified != 0;
+    }
+
+    inline void invalidate_timestamps() {
+        this->created = this->modified = 0;
+    }
+};
+ASSERT_SIZE(Object, 0x20);
+ASSERT_STANDARD_LAYOUT(Object);
+
+// Directory-only data, kept out of Object since most entries are files
+struct Directory {
+    std::uint64_t              stamp      = 0; // Fingerprint of the last listing
+    std::uint32_t              generation = 0; // Storage generation at which the listing last changed
+    std::uint32_t              session    = 0; // Session in which the directory was last listed
+    std::vector<Object::Index> children;
+};
+
+// Objects are allocated in fixed-size chunks, so references stay valid as the arena grows
+class ObjectArena {
+    public:
+        constexpr static std::size_t chunk_bits = 12;
+        constexpr static std::size_t chunk_size = 1 << chunk_bits;
+
+        inline Object &operator[](Object::Index idx) {
+            return this->chunks[idx >> chunk_bits][idx & (chunk_size - 1)];
+        }
+
+        inline const Object &operator[](Object::Index idx) const {
+            return this->chunks[idx >> chunk_bits][idx & (chunk_size - 1)];
+        }
+
+        inline Object::Index allocate() {
+            if (!this->free_slots.empty()) {
+                auto idx = this->free_slots.back();
+                this->free_slots.pop_back();
+                return idx;
+            }
+
+            if ((this->count & (chunk_size - 1)) == 0)
+                this->chunks.emplace_back(new Object[chunk_size]);
+            return this->count++;
+        }
+
+        inline void free(Object::Index idx) {
+            (*this)[idx] = {};
+            this->free_slots.push_back(idx);
+        }
+
+        // Number of slots handed out, including the ones that were freed since
+        inline std::size_t capacity() const {
+            return this->count;
+        }
+
+        inline std::size_t size() const {
+            return this->count - this->free_slots.size();
+        }
+
+    private:
+        std::vector<std::unique_ptr<Object[]>> chunks;
+        std::vector<Object::Index>             free_slots;
+        Object::Index                          count = 0;
 };
 
 } // namespace nq::mtp
@@ -2,10 +2,12 @@
 
 #include <cstdint>
 #include <array>
+#include <limits>
 #include <vector>
 #include <algorithm>
 #include <type_traits>
 
+#include "content_hasher.hpp"
 #include "error.hpp"
 #include "fs.hpp"
 #include "mtp_codes.hpp"
@@ -102,6 +104,22 @@ struct ResponsePacket: public OutPacket<5> {
     }
 };
 
+struct EventPacket: public Packet<3> {
+    constexpr inline EventPacket(EventCode code, std::uint32_t transaction_id, std::uint32_t param) {
+        this->header.size           = sizeof(PacketHeader) + sizeof(std::uint32_t);
+        this->header.type           = PacketType::Event;
+        this->header.code           = static_cast<TransactionCode>(code);
+        this->header.transaction_id = transaction_id;
+        this->params[0]             = param;
+    }
+
+    inline Result send() const {
+        std::size_t sent;
+        R_TRY_RETURN(usb::send_event(this, this->size(), &sent));
+        return (sent == this->size()) ? Result::success() : err::FailedUsbSend;
+    }
+};
+
 struct DataPacket {
     PacketHeader              header = {};
     std::size_t               offset = 0;
@@ -196,8 +214,103 @@ struct DataPacket {
     Result receive();
     Result send();
 
-    Result stream_from_file(fs::File &file, std::size_t size, std::size_t offset = 0);
-    Result stream_to_file(fs::File &file, std::size_t size, std::size_t offset = 0);
+    // Data phases of unknown size are announced as too large for the header, and end with a short transfer
+    constexpr static std::size_t unknown_size = std::numeric_limits<std::size_t>::max();
+
+    // Sends a data phase of the given size with double-buffered usb transfers. fill(buf, max_size) produces the next
+    // chunk into buf while the previous one is in flight, and returns its size. With unknown_size, the phase ends
+    // with the first chunk fill returns short
+    template <typename F>
+    Result stream(std::size_t size, F &&fill) {
+        bool until_short = size == unknown_size;
+        if (until_short || (size + sizeof(PacketHeader) >= std::numeric_limits<decltype(PacketHeader::size)>::max()))
+            this->header.size = 0xffffffff;
+        else
+            this->header.size = sizeof(PacketHeader) + size;
+
+        DTRACE(&this->header, sizeof(PacketHeader));
+
+        std::size_t sent;
+        R_TRY_RETURN(usb::send(this, sizeof(PacketHeader), &sent));
+        TRY_RETURNV(sent == sizeof(PacketHeader), err::FailedUsbSend);
+
+        if (size == 0)
+            return Result::success();
+
+        constexpr std::size_t chunk_size = usb::endpoint_buffer_size;
+        std::uint32_t urb_id;
+
+        usb::snd_dbuf_reset();
+        R_TRY_RETURN(usb::set_zlt(usb::get_in_endpoint(), false));
+        std::size_t read = fill(usb::snd_dbuf_get_cur_buf(), chunk_size);
+        R_TRY_RETURN(usb::snd_dbuf_begin(read, &urb_id));
+
+        // A full last chunk is followed by an empty one, which the host sees as a null packet
+        while (until_short ? (read == chunk_size) : size) {
+            usb::snd_dbuf_swap();
+            std::size_t tmp_read = fill(usb::snd_dbuf_get_cur_buf(), chunk_size);
+
+            R_TRY_RETURN(usb::snd_dbuf_wait(urb_id, &sent));
+            TRY_RETURNV(sent == read, err::FailedUsbSend);
+            size -= until_short ? 0 : sent;
+            read  = tmp_read;
+
+            R_TRY_RETURN(usb::snd_dbuf_begin(read, &urb_id));
+        }
+
+        R_TRY_RETURN(usb::snd_dbuf_wait(urb_id, &sent));
+        TRY_RETURNV(sent == read, err::FailedUsbSend);
+
+        return Result::success();
+    }
+
+    // Receives a data phase with double-buffered usb transfers, consume(buf, size) is handed each chunk while the
+    // next one is in flight. With unknown_size, the size is taken from the packet header, and the phase ends with
+    // the first short transfer for payloads too large for the header to tell
+    template <typename F>
+    Result receive_stream(std::size_t size, F &&consume) {
+        std::size_t received;
+        R_TRY_RETURN(usb::receive(this, sizeof(PacketHeader), &received));
+        TRY_RETURNV(received == sizeof(PacketHeader), err::FailedUsbReceive);
+        DTRACE(&this->header, sizeof(PacketHeader));
+
+        if ((size == unknown_size) && (this->header.size != 0xffffffff))
+            size = this->header.size - std::min<std::size_t>(this->header.size, sizeof(PacketHeader));
+
+        if (size == 0)
+            return Result::success();
+
+        constexpr std::size_t chunk_size = usb::endpoint_buffer_size;
+        std::uint32_t urb_id;
+
+        usb::rcv_dbuf_reset();
+        R_TRY_RETURN(usb::rcv_dbuf_begin(chunk_size, &urb_id));
+        R_TRY_RETURN(usb::rcv_dbuf_wait(urb_id, &received));
+        size -= std::min(size, received);
+
+        while (size && (received == chunk_size)) {
+            void *buf = usb::rcv_dbuf_get_cur_buf();
+            usb::rcv_dbuf_swap();
+            R_TRY_RETURN(usb::rcv_dbuf_begin(chunk_size, &urb_id));
+
+            consume(buf, received);
+
+            R_TRY_RETURN(usb::rcv_dbuf_wait(urb_id, &received));
+            size -= std::min(size, received);
+        }
+
+        consume(usb::rcv_dbuf_get_cur_buf(), received);
+
+        // End of data transfer is indicated by short or null packet
+        if (received == chunk_size)
+            R_TRY_RETURN(usb::receive(usb::rcv_dbuf_get_cur_buf(), chunk_size, &received));
+
+        return Result::success();
+    }
+
+    // The hasher, if any, is fed the data while the usb transfers are in flight
+    Result stream_from_file(fs::File &file, std::size_t size, std::size_t offset = 0, fs::StreamHasher *hasher = nullptr);
+    Result stream_to_file(fs::File &file, std::size_t size, std::size_t offset = 0, fs::StreamHasher *hasher = nullptr);
 };
 
 } // namespace nq::mtp
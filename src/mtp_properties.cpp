@@ -1,4 +1,7 @@
+#include <algorithm>
+
 #include "mtp_codes.hpp"
+#include "mtp_formats.hpp"
 #include "mtp_types.hpp"
 #include "mtp_object.hpp"
 #include "mtp_packet.hpp"
@@ -48,6 +51,11 @@ ResponseCode get_device_prop_value(DataPacket &packet, DevicePropertyCode proper
 }
 
 ResponseCode get_object_props_supported(DataPacket &packet, ObjectFormatCode format) {
+    // Files of detected formats without specific properties share the generic ones
+    if (!obj::supported.count(format) &&
+            (std::find(formats::detected.begin(), formats::detected.end(), format) != formats::detected.end()))
+        format = ObjectFormatCode::Undefined;
+
     Array<ObjectPropertyCode> props;
     if (auto it = obj::supported.find(format); it != obj::supported.end()) {
         props.add(it->second);
@@ -65,6 +73,7 @@ ResponseCode get_object_prop_desc(DataPacket &packet, ObjectPropertyCode propert
                 ObjectPropDesc<StorageId> prop;
                 prop.code          = ObjectPropertyCode::StorageID;
                 prop.type          = TypeCode::UINT32;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Object_Format: {
@@ -72,12 +81,14 @@ ResponseCode get_object_prop_desc(DataPacket &packet, ObjectPropertyCode propert
                 prop.code          = ObjectPropertyCode::Object_Format;
                 prop.type          = TypeCode::UINT16;
                 prop.default_value = ObjectFormatCode::Undefined;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Object_Size: {
                 ObjectPropDesc<std::uint64_t> prop;
                 prop.code          = ObjectPropertyCode::Object_Size;
                 prop.type          = TypeCode::UINT64;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Object_File_Name: {
@@ -85,6 +96,7 @@ ResponseCode get_object_prop_desc(DataPacket &packet, ObjectPropertyCode propert
                 prop.code          = ObjectPropertyCode::Object_File_Name;
                 prop.type          = TypeCode::STR;
                 prop.get_set       = 1; // Get/set
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Date_Created: {
@@ -92,6 +104,7 @@ ResponseCode get_object_prop_desc(DataPacket &packet, ObjectPropertyCode propert
                 prop.code          = ObjectPropertyCode::Date_Created;
                 prop.type          = TypeCode::STR;
                 prop.form_flag     = Forms::DateTime;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Date_Modified: {
@@ -99,12 +112,32 @@ ResponseCode get_object_prop_desc(DataPacket &packet, ObjectPropertyCode propert
                 prop.code          = ObjectPropertyCode::Date_Modified;
                 prop.type          = TypeCode::STR;
                 prop.form_flag     = Forms::DateTime;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         case ObjectPropertyCode::Parent_Object: {
                 ObjectPropDesc<Object::Handle> prop;
                 prop.code          = ObjectPropertyCode::Parent_Object;
                 prop.type          = TypeCode::UINT32;
+                prop.group_code    = obj::get_group(prop.code);
+                prop.push_to(packet);
+            } break;
+        case ObjectPropertyCode::Persistent_Unique_Object_Identifier:
+        case ObjectPropertyCode::Content_Hash: {
+                ObjectPropDesc<std::array<std::uint8_t, 16>> prop;
+                prop.code          = property;
+                prop.type          = TypeCode::UINT128;
+                prop.group_code    = obj::get_group(prop.code);
+                prop.push_to(packet);
+            } break;
+        case ObjectPropertyCode::Width:
+        case ObjectPropertyCode::Height:
+        case ObjectPropertyCode::Duration:
+        case ObjectPropertyCode::Content_CRC32: {
+                ObjectPropDesc<std::uint32_t> prop;
+                prop.code          = property;
+                prop.type          = TypeCode::UINT32;
+                prop.group_code    = obj::get_group(prop.code);
                 prop.push_to(packet);
             } break;
         default:
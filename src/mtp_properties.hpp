@@ -17,27 +17,82 @@ static inline String synchronization_partner = u"Nuqe";
 
 namespace obj {
 
-static inline std::unordered_map<ObjectFormatCode, std::vector<ObjectPropertyCode>> supported = {
-    {
-        ObjectFormatCode::Undefined, std::vector{
-            ObjectPropertyCode::StorageID,
-            ObjectPropertyCode::Object_Format,
-            ObjectPropertyCode::Object_Size,
-            ObjectPropertyCode::Object_File_Name,
-            ObjectPropertyCode::Date_Created,
-            ObjectPropertyCode::Date_Modified,
-            ObjectPropertyCode::Parent_Object,
-        }
-    },
-    {
-        ObjectFormatCode::Association, std::vector{
-            ObjectPropertyCode::StorageID,
-            ObjectPropertyCode::Object_Format,
-            ObjectPropertyCode::Object_File_Name,
-            ObjectPropertyCode::Parent_Object,
-        }
-    },
-};
+static inline std::unordered_map<ObjectFormatCode, std::vector<ObjectPropertyCode>> supported = [] {
+    auto file = std::vector{
+        ObjectPropertyCode::StorageID,
+        ObjectPropertyCode::Object_Format,
+        ObjectPropertyCode::Object_Size,
+        ObjectPropertyCode::Object_File_Name,
+        ObjectPropertyCode::Date_Created,
+        ObjectPropertyCode::Date_Modified,
+        ObjectPropertyCode::Parent_Object,
+        ObjectPropertyCode::Persistent_Unique_Object_Identifier,
+        ObjectPropertyCode::Content_Hash,
+        ObjectPropertyCode::Content_CRC32,
+    };
+
+    // Media formats additionally expose what's parsed from their headers
+    auto image = file;
+    image.insert(image.end(), { ObjectPropertyCode::Width, ObjectPropertyCode::Height });
+    auto video = image;
+    video.push_back(ObjectPropertyCode::Duration);
+
+    return std::unordered_map<ObjectFormatCode, std::vector<ObjectPropertyCode>>{
+        { ObjectFormatCode::Undefined,      file  },
+        { ObjectFormatCode::EXIF_JPEG,      image },
+        { ObjectFormatCode::JFIF,           image },
+        { ObjectFormatCode::PNG,            image },
+        { ObjectFormatCode::GIF,            image },
+        { ObjectFormatCode::BMP,            image },
+        { ObjectFormatCode::MP4_Container,  video },
+        { ObjectFormatCode::_3GP_Container, video },
+        {
+            ObjectFormatCode::Association, std::vector{
+                ObjectPropertyCode::StorageID,
+                ObjectPropertyCode::Object_Format,
+                ObjectPropertyCode::Object_File_Name,
+                ObjectPropertyCode::Parent_Object,
+                ObjectPropertyCode::Persistent_Unique_Object_Identifier,
+            }
+        },
+    };
+}();
+
+// Property groups, advertised through prop descs so that hosts can fetch subsets with GetObjectPropList
+namespace group {
+
+constexpr inline std::uint32_t listing  = 1; // Served from the index, no filesystem access
+constexpr inline std::uint32_t extended = 2; // Needs a per-object filesystem query
+constexpr inline std::uint32_t content  = 3; // Reads whole files
+
+} // namespace group
+
+constexpr inline std::uint32_t get_group(ObjectPropertyCode property) {
+    switch (property) {
+        case ObjectPropertyCode::StorageID:
+        case ObjectPropertyCode::Object_Format:
+        case ObjectPropertyCode::Object_Size:
+        case ObjectPropertyCode::Object_File_Name:
+        case ObjectPropertyCode::Parent_Object:
+        case ObjectPropertyCode::Persistent_Unique_Object_Identifier:
+            return group::listing;
+        case ObjectPropertyCode::Date_Created:
+        case ObjectPropertyCode::Date_Modified:
+        case ObjectPropertyCode::Width:
+        case ObjectPropertyCode::Height:
+        case ObjectPropertyCode::Duration:
+            return group::extended;
+        case ObjectPropertyCode::Content_Hash:
+        case ObjectPropertyCode::Content_CRC32:
+            return group::content;
+        default:
+            return 0;
+    }
+}
+
+constexpr inline bool is_group_supported(std::uint32_t group_code) {
+    return (group_code == group::listing) || (group_code == group::extended) || (group_code == group::content);
+}
 
 } // namespace obj
 
@@ -41,7 +41,23 @@ Result Server::process() {
     TRACE("Sending response %#x\n", response.header.code);
     DTRACE(&response, response.size());
 
-    return response.send();
+    R_TRY_RETURN(response.send());
+
+    this->storage_manager.poll_jobs();
+    this->send_events(request);
+    return Result::success();
+}
+
+void Server::send_events(const RequestPacket &request) {
+    std::vector<StorageEvent> events;
+    this->storage_manager.take_events(events);
+    if (!this->session_opened)
+        return;
+
+    for (auto &&event: events) {
+        TRACE("Sending event %#x (handle %#x)\n", event.code, event.handle);
+        R_TRY(EventPacket(event.code, request.header.transaction_id, event.handle).send(), break);
+    }
 }
 
 ResponsePacket Server::handle_request(const RequestPacket &request) {
@@ -56,12 +72,16 @@ ResponsePacket Server::handle_request(const RequestPacket &request) {
             return this->get_storage_ids(request);
         case OperationCode::GetStorageInfo:
             return this->get_storage_info(request);
+        case OperationCode::GetNumObjects:
+            return this->get_num_objects(request);
         case OperationCode::GetObjectHandles:
             return this->get_object_handles(request);
         case OperationCode::GetObjectInfo:
             return this->get_object_info(request);
         case OperationCode::GetObject:
             return this->get_object(request);
+        case OperationCode::GetThumb:
+            return this->get_thumb(request);
         case OperationCode::DeleteObject:
             return this->delete_object(request);
         case OperationCode::SendObjectInfo:
@@ -88,6 +108,32 @@ ResponsePacket Server::handle_request(const RequestPacket &request) {
             return this->set_object_prop_value(request);
         case OperationCode::GetObjectPropList:
             return this->get_object_prop_list(request);
+        case OperationCode::GetObjectInfoList:
+            return this->get_object_info_list(request);
+        case OperationCode::GetObjectTree:
+            return this->get_object_tree(request);
+        case OperationCode::GetObjectChanges:
+            return this->get_object_changes(request);
+        case OperationCode::SearchObjects:
+            return this->search_objects(request);
+        case OperationCode::GetSearchResults:
+            return this->get_search_results(request);
+        case OperationCode::GetObjectHandlesPaged:
+            return this->get_object_handles_paged(request);
+        case OperationCode::GetObjectArchive:
+            return this->get_object_archive(request);
+        case OperationCode::SendObjectArchive:
+            return this->send_object_archive(request);
+        case OperationCode::GetObjectSignatures:
+            return this->get_object_signatures(request);
+        case OperationCode::SendObjectDelta:
+            return this->send_object_delta(request);
+        case OperationCode::GetObjectCompressed:
+            return this->get_object_compressed(request);
+        case OperationCode::SendObjectCompressed:
+            return this->send_object_compressed(request);
+        case OperationCode::GetCommitStats:
+            return this->get_commit_stats(request);
         default:
             ERROR("Request %#x not implemented\n", request.header.code);
             return ResponseCode::Invalid_TransactionID;
@@ -118,12 +164,17 @@ ResponsePacket Server::get_device_info(const RequestPacket &request) {
 
 ResponsePacket Server::open_session(const RequestPacket &request) {
     TRACE("Opening session (id %d)\n", request.get(0));
+    this->storage_manager.load_indices();
+    this->storage_manager.invalidate_trees();
     this->session_opened = true;
     return ResponseCode::OK;
 }
 
 ResponsePacket Server::close_session(const RequestPacket &request) {
     TRACE("Closing session (id %d)\n", request.get(0));
+    this->storage_manager.close_paged_listings();
+    this->storage_manager.commit_storages();
+    this->storage_manager.save_indices();
     this->session_opened = false;
     return ResponseCode::OK;
 }
@@ -146,21 +197,27 @@ ResponsePacket Server::get_storage_info(const RequestPacket &request) {
     return SEND_DPACKET(storage_info);
 }
 
+ResponsePacket Server::get_num_objects(const RequestPacket &request) {
+    TRACE("Counting objects (device %#x, object format %#x, parent %#x)\n", request.get(0), request.get(1), request.get(2));
+
+    std::vector<Object::Handle> handles;
+    MTP_TRY_RETURN(this->storage_manager.find_objects(request.get(0), request.get<ObjectFormatCode>(1), request.get(2), handles));
+
+    auto response = ResponsePacket(ResponseCode::OK);
+    response.set_params(std::array{
+        static_cast<std::uint32_t>(handles.size()),
+    });
+    return response;
+}
+
 ResponsePacket Server::get_object_handles(const RequestPacket &request) {
     TRACE("Sending object handles (device %#x, object format %#x, parent %#x)\n", request.get(0), request.get(1), request.get(2));
-    if (request.get(1)) {
-        ERROR("Filtering by format %#x not supported\n", request.get(1));
-        return ResponseCode::Specification_By_Format_Unsupported;
-    }
-
-    Storage *storage = nullptr;
-    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
 
-    Object *object = storage->find_handle(request.get(2));
-    TRY_RETURNV(object != nullptr, ResponseCode::Invalid_ObjectHandle);
+    std::vector<Object::Handle> handles;
+    MTP_TRY_RETURN(this->storage_manager.find_objects(request.get(0), request.get<ObjectFormatCode>(1), request.get(2), handles));
 
     DataPacket object_handles(request);
-    MTP_TRY_RETURN(storage->get_object_handles(object_handles, object));
+    object_handles.push(Array<Object::Handle>(handles));
     return SEND_DPACKET(object_handles);
 }
 
@@ -196,6 +253,17 @@ ResponsePacket Server::get_object(const RequestPacket &request) {
     return storage->get_object(packet, object);
 }
 
+ResponsePacket Server::get_thumb(const RequestPacket &request) {
+    TRACE("Getting thumbnail (handle %#x)\n", request.get(0));
+
+    Storage *storage = nullptr; Object *object = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
+
+    auto thumb = DataPacket(request);
+    MTP_TRY_RETURN(storage->get_thumb(thumb, object));
+    return SEND_DPACKET(thumb);
+}
+
 ResponsePacket Server::send_object_info(const RequestPacket &request) {
     TRACE("Sending object info (storage %#010x, parent %#x)\n", request.get(0), request.get(1));
     auto packet = DataPacket();
@@ -240,16 +308,15 @@ ResponsePacket Server::move_object(const RequestPacket &request) {
     Storage *storage = nullptr; Object *object = nullptr;
     MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
 
-    // Moving objects between stores is not supported
-    if (storage->id != request.get(1))
-        return ResponseCode::Store_Not_Available;
+    Storage *dest = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(1), &dest));
 
     Object::Handle parent = request.get(2);
     if (request.get(2) == 0)
         parent = root_handle;
 
     Object::Handle new_handle;
-    auto response = ResponsePacket(storage->move_object(object, parent, new_handle));
+    auto response = ResponsePacket(storage->move_object(object, *dest, parent, new_handle));
     response.set_params(std::array{new_handle});
     return response;
 }
@@ -260,16 +327,15 @@ ResponsePacket Server::copy_object(const RequestPacket &request) {
     Storage *storage = nullptr; Object *object = nullptr;
     MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
 
-    // Copying objects between stores is not supported
-    if (storage->id != request.get(1))
-        return ResponseCode::Store_Not_Available;
+    Storage *dest = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(1), &dest));
 
     Object::Handle parent = request.get(2);
     if (request.get(2) == 0)
         parent = root_handle;
 
     Object::Handle new_handle;
-    auto response = ResponsePacket(storage->copy_object(object, parent, new_handle));
+    auto response = ResponsePacket(storage->copy_object(object, *dest, parent, new_handle));
     response.set_params(std::array{new_handle});
     return response;
 }
@@ -325,13 +391,257 @@ ResponsePacket Server::get_object_prop_list(const RequestPacket &request) {
     TRACE("Getting object prop list: (handle %#x, format %#x, prop code %#x, prop group code %#x, depth %#x)\n",
         request.get(0), request.get(1), request.get(2), request.get(3), request.get(4));
 
-    Storage *storage = nullptr; Object *object = nullptr;
-    MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
-
     auto prop_list = DataPacket(request);
-    MTP_TRY_RETURN(storage->get_object_prop_list(prop_list, object,
+    MTP_TRY_RETURN(this->storage_manager.get_object_prop_list(prop_list, request.get(0),
         request.get<ObjectFormatCode>(1), request.get<ObjectPropertyCode>(2), request.get(3), request.get(4)));
     return SEND_DPACKET(prop_list);
 }
 
+// Parameters are those of GetObjectHandles. The dataset is the number of objects, followed by
+// the handle and ObjectInfo dataset of each one, saving a transaction per object when listing a folder
+ResponsePacket Server::get_object_info_list(const RequestPacket &request) {
+    TRACE("Sending object info list (device %#x, object format %#x, parent %#x)\n", request.get(0), request.get(1), request.get(2));
+
+    std::vector<Object::Handle> handles;
+    MTP_TRY_RETURN(this->storage_manager.find_objects(request.get(0), request.get<ObjectFormatCode>(1), request.get(2), handles));
+
+    auto object_infos = DataPacket(request);
+    object_infos.buffer.reserve(0x80 * handles.size());
+    object_infos.push(static_cast<std::uint32_t>(handles.size()));
+    for (auto &&handle: handles) {
+        Storage *storage = nullptr; Object *object = nullptr;
+        MTP_TRY_RETURN(this->storage_manager.find_handle(handle, &storage, &object));
+
+        object_infos.push(handle);
+        MTP_TRY_RETURN(storage->get_object_info(object_infos, object));
+    }
+    return SEND_DPACKET(object_infos);
+}
+
+// Parameters are the storage, the directory (0 for the root), the depth (0xffffffff for the whole subtree)
+// and flags. The dataset is the number of entries followed by the entries (see TreeEntry)
+ResponsePacket Server::get_object_tree(const RequestPacket &request) {
+    constexpr std::uint32_t flag_timestamps = 1 << 0; // Query modification times that aren't cached yet
+
+    TRACE("Sending object tree (storage %#010x, parent %#x, depth %#x, flags %#x)\n",
+        request.get(0), request.get(1), request.get(2), request.get(3));
+
+    Storage *storage = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
+
+    auto *object = storage->find_handle(request.get(1) ? request.get(1) : root_handle);
+    TRY_RETURNV(object, ResponseCode::Invalid_ObjectHandle);
+
+    auto tree = DataPacket(request);
+    MTP_TRY_RETURN(storage->get_object_tree(tree, object, request.get(2), request.get(3) & flag_timestamps));
+    return SEND_DPACKET(tree);
+}
+
+// Parameters are the storage, the journal id and the 64-bit sequence number (low word first) returned by the
+// previous call, or zeroes on the first sync. The dataset is the journal id, the current sequence number,
+// a rescan flag set when the changes since the given token are no longer known, then the changes (see JournalEntry)
+ResponsePacket Server::get_object_changes(const RequestPacket &request) {
+    TRACE("Sending object changes (storage %#010x, journal %#x, seq %#x%08x)\n",
+        request.get(0), request.get(1), request.get(3), request.get(2));
+
+    Storage *storage = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
+
+    auto seq = (static_cast<std::uint64_t>(request.get(3)) << 32) | request.get(2);
+    auto changes = DataPacket(request);
+    MTP_TRY_RETURN(storage->get_object_changes(changes, request.get(1), seq));
+    return SEND_DPACKET(changes);
+}
+
+// Parameters are the storage, the directory to search (0 for the root) and the maximum number of results (0 for
+// no limit), the data phase is the pattern. Patterns without wildcards match substrings. The number of matches
+// is returned, the matches themselves are kept for GetSearchResults, like SendObjectInfo/SendObject
+ResponsePacket Server::search_objects(const RequestPacket &request) {
+    TRACE("Searching objects (storage %#010x, parent %#x, max results %#x)\n", request.get(0), request.get(1), request.get(2));
+    auto packet = DataPacket();
+    R_TRY_RETURNV(packet.receive(), ResponseCode::General_Error);
+    DUMP_DPACKET(packet);
+
+    auto pattern = to_utf8(packet.pop().chars);
+    if (pattern.find_first_of("*?") == std::string::npos)
+        pattern = '*' + pattern + '*';
+
+    auto max_results = request.get(2) ? request.get(2) : std::numeric_limits<std::size_t>::max();
+    this->search_results.clear();
+    MTP_TRY_RETURN(this->storage_manager.search_objects(request.get(0), request.get(1), pattern, max_results, this->search_results));
+    TRACE("Found %zu matches for %s\n", this->search_results.size(), pattern.c_str());
+
+    auto response = ResponsePacket(ResponseCode::OK);
+    response.set_params(std::array{
+        static_cast<std::uint32_t>(this->search_results.size()),
+    });
+    return response;
+}
+
+// The dataset is the number of matches, followed by the handle, 16-bit path size and utf-8 path of each one.
+// Objects removed since the search are left out
+ResponsePacket Server::get_search_results(const RequestPacket &request) {
+    TRACE("Sending search results (%zu matches)\n", this->search_results.size());
+
+    auto results = DataPacket(request);
+    results.push(0u); // Reserve nb results
+
+    std::uint32_t nb_results = 0;
+    for (auto &&handle: this->search_results) {
+        Storage *storage = nullptr; Object *object = nullptr;
+        if (this->storage_manager.find_handle(handle, &storage, &object) != ResponseCode::OK)
+            continue;
+
+        auto path = storage->get_path(*object);
+        results.push(handle);
+        results.push(static_cast<std::uint16_t>(path.size()));
+        results.buffer.insert(results.buffer.end(), path.begin(), path.end());
+        ++nb_results;
+    }
+
+    *reinterpret_cast<std::uint32_t *>(results.buffer.begin().base()) = nb_results;
+    this->search_results = {};
+    return SEND_DPACKET(results);
+}
+
+// Parameters are the storage, the directory (0 for the root), the offset and the maximum number of handles (0 for
+// all remaining ones). The dataset is a handle array as with GetObjectHandles, the response parameter is the number
+// of entries in the directory, exact once the listing has ended
+ResponsePacket Server::get_object_handles_paged(const RequestPacket &request) {
+    TRACE("Sending object handles page (storage %#010x, parent %#x, offset %#x, limit %#x)\n",
+        request.get(0), request.get(1), request.get(2), request.get(3));
+
+    Storage *storage = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
+
+    auto *object = storage->find_handle(request.get(1) ? request.get(1) : root_handle);
+    TRY_RETURNV(object, ResponseCode::Invalid_ObjectHandle);
+
+    std::vector<Object::Handle> handles; std::uint32_t total = 0;
+    MTP_TRY_RETURN(storage->find_objects_paged(object, request.get(2), request.get(3), handles, total));
+
+    DataPacket object_handles(request);
+    object_handles.push(Array<Object::Handle>(handles));
+    DUMP_DPACKET(object_handles);
+    R_TRY_RETURNV(object_handles.send(), ResponseCode::General_Error);
+
+    auto response = ResponsePacket(ResponseCode::OK);
+    response.set_params(std::array{
+        total,
+    });
+    return response;
+}
+
+// Parameters are the storage and the object (0 for the root), the dataset is a tar archive of the object and
+// its subtree, with names relative to the object's parent
+ResponsePacket Server::get_object_archive(const RequestPacket &request) {
+    TRACE("Getting object archive (storage %#010x, handle %#x)\n", request.get(0), request.get(1));
+
+    Storage *storage = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
+
+    auto *object = storage->find_handle(request.get(1) ? request.get(1) : root_handle);
+    TRY_RETURNV(object, ResponseCode::Invalid_ObjectHandle);
+
+    auto packet = DataPacket(request);
+    return storage->get_object_archive(packet, object);
+}
+
+// Parameters are the storage and the destination directory (0 for the root), the dataset is a tar archive.
+// The response parameter is the number of entries unpacked
+ResponsePacket Server::send_object_archive(const RequestPacket &request) {
+    TRACE("Sending object archive (storage %#010x, parent %#x)\n", request.get(0), request.get(1));
+    auto packet = DataPacket();
+
+    // The data phase still has to be consumed when the request is rejected
+    auto discard = [&packet](ResponseCode code) {
+        packet.receive_stream(DataPacket::unknown_size, [](void *, std::size_t) { });
+        return code;
+    };
+
+    Storage *storage = nullptr;
+    if (auto code = this->storage_manager.find_storage(request.get(0), &storage); code != ResponseCode::OK)
+        return discard(code);
+
+    auto *object = storage->find_handle(request.get(1) ? request.get(1) : root_handle);
+    if (!object)
+        return discard(ResponseCode::Invalid_ObjectHandle);
+
+    std::uint32_t nb_entries = 0;
+    MTP_TRY_RETURN(storage->send_object_archive(packet, object, nb_entries));
+
+    auto response = ResponsePacket(ResponseCode::OK);
+    response.set_params(std::array{
+        nb_entries,
+    });
+    return response;
+}
+
+// Parameters are the object and the block size (0 for the default). The dataset is the block size actually used,
+// the 64-bit object size, the number of blocks, and the weak and strong checksums of each (see fs::delta)
+ResponsePacket Server::get_object_signatures(const RequestPacket &request) {
+    TRACE("Getting object signatures (handle %#x, block size %#x)\n", request.get(0), request.get(1));
+
+    Storage *storage = nullptr; Object *object = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
+
+    auto packet = DataPacket(request);
+    MTP_TRY_RETURN(storage->get_object_signatures(packet, object, request.get(1)));
+    return SEND_DPACKET(packet);
+}
+
+// Parameters are the object and the low and high words of its new size, the dataset is a sequence of
+// fs::delta::Instruction, literal ones followed by their data
+ResponsePacket Server::send_object_delta(const RequestPacket &request) {
+    auto size = static_cast<std::uint64_t>(request.get(2)) << 32 | request.get(1);
+    TRACE("Sending object delta (handle %#x, size %#lx)\n", request.get(0), size);
+    auto packet = DataPacket();
+
+    Storage *storage = nullptr; Object *object = nullptr;
+    if (auto code = this->storage_manager.find_handle(request.get(0), &storage, &object); code != ResponseCode::OK) {
+        packet.receive_stream(DataPacket::unknown_size, [](void *, std::size_t) { });
+        return code;
+    }
+
+    return storage->send_object_delta(packet, object, size);
+}
+
+// Parameter is the object, the dataset is its contents as a sequence of fs::FrameHeader, each followed by an LZ4
+// block or stored data. Its size isn't announced, the host reads until a short transfer
+ResponsePacket Server::get_object_compressed(const RequestPacket &request) {
+    TRACE("Getting compressed object (handle %#x)\n", request.get(0));
+
+    Storage *storage = nullptr; Object *object = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_handle(request.get(0), &storage, &object));
+
+    auto packet = DataPacket(request);
+    return storage->get_object_compressed(packet, object);
+}
+
+// Follows SendObjectInfo like SendObject, the dataset is framed as for GetObjectCompressed. Frames hold at most
+// fs::FramePipeline::frame_size bytes of raw data
+ResponsePacket Server::send_object_compressed(const RequestPacket &request) {
+    TRACE("Sending compressed object (handle %#x)\n", this->last_sent_object->handle);
+    auto packet = DataPacket(request);
+    return this->last_sent_storage->send_object_compressed(packet, this->last_sent_object);
+}
+
+// The parameter is the storage. The dataset is the number of commits, of failed ones, the committed size (64-bit),
+// then the total and maximum commit latencies in microseconds (64-bit), all since the server started
+ResponsePacket Server::get_commit_stats(const RequestPacket &request) {
+    TRACE("Sending commit stats (storage %#010x)\n", request.get(0));
+
+    Storage *storage = nullptr;
+    MTP_TRY_RETURN(this->storage_manager.find_storage(request.get(0), &storage));
+
+    auto stats = storage->get_commit_stats();
+    auto packet = DataPacket(request);
+    packet.push(stats.nb_commits);
+    packet.push(stats.nb_failures);
+    packet.push(stats.committed_size);
+    packet.push(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(stats.total_latency).count()));
+    packet.push(static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(stats.max_latency).count()));
+    return SEND_DPACKET(packet);
+}
+
 } // namespace nq::mtp
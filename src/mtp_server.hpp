@@ -3,6 +3,7 @@
 #include <atomic>
 #include <string>
 
+#include "mtp_formats.hpp"
 #include "mtp_packet.hpp"
 #include "mtp_storage.hpp"
 #include "mtp_object.hpp"
@@ -17,7 +18,7 @@ namespace info {
 static inline std::uint16_t standard_version         = 100;        // PTP version: 1.0.0
 static inline std::uint32_t vendor_extension_id      = 6;          // MTP id -- Spec specifies 0xffffffff should be used but libmtp warns that this id is usually used by PTP devices
 static inline std::uint16_t vendor_extension_version = 110;        // MTP version: 1.1.0
-static inline String        mtp_extensions           = {};
+static inline String        mtp_extensions           = u"nuqe: 1.0;";
 static inline std::uint16_t functional_mode          = 0;
 static inline String        manufacturer             = u"Nintendo";
 static inline String        model                    = u"Switch";
@@ -30,9 +31,11 @@ static inline Array<OperationCode> supported_operations = std::array{
     OperationCode::CloseSession,
     OperationCode::GetStorageIDs,
     OperationCode::GetStorageInfo,
+    OperationCode::GetNumObjects,
     OperationCode::GetObjectHandles,
     OperationCode::GetObjectInfo,
     OperationCode::GetObject,
+    OperationCode::GetThumb,
     OperationCode::DeleteObject,
     OperationCode::SendObjectInfo,
     OperationCode::SendObject,
@@ -46,10 +49,24 @@ static inline Array<OperationCode> supported_operations = std::array{
     OperationCode::GetObjectPropValue,
     OperationCode::SetObjectPropValue,
     OperationCode::GetObjectPropList,
+    OperationCode::GetObjectInfoList,
+    OperationCode::GetObjectTree,
+    OperationCode::GetObjectChanges,
+    OperationCode::SearchObjects,
+    OperationCode::GetSearchResults,
+    OperationCode::GetObjectHandlesPaged,
+    OperationCode::GetObjectArchive,
+    OperationCode::SendObjectArchive,
+    OperationCode::GetObjectSignatures,
+    OperationCode::SendObjectDelta,
+    OperationCode::GetObjectCompressed,
+    OperationCode::SendObjectCompressed,
+    OperationCode::GetCommitStats,
 };
 
 static inline Array<EventCode> supported_events = std::array{
-    EventCode::Undefined,
+    EventCode::ObjectRemoved,
+    EventCode::ObjectInfoChanged,
 };
 
 static inline Array<DevicePropertyCode> supported_device_properties = std::array{
@@ -61,21 +78,26 @@ static inline Array<ObjectFormatCode> supported_capture_formats = std::array{
     ObjectFormatCode::Undefined,
 };
 
-static inline Array<ObjectFormatCode> supported_playback_formats = std::array{
-    ObjectFormatCode::Undefined,
-    ObjectFormatCode::Association,
-};
+static inline Array<ObjectFormatCode> supported_playback_formats = [] {
+    Array<ObjectFormatCode> formats = std::array{
+        ObjectFormatCode::Undefined,
+        ObjectFormatCode::Association,
+    };
+    formats.add(formats::detected);
+    return formats;
+}();
 
 } // namespace info
 
 class Server {
     public:
-        Server(const StorageManager &storage_manager): storage_manager(storage_manager) { }
+        Server(StorageManager &storage_manager): storage_manager(storage_manager) { }
 
         Result process();
 
     private:
         ResponsePacket handle_request(const RequestPacket &packet);
+        void send_events(const RequestPacket &request);
 
     protected:
         ResponsePacket get_device_info(const RequestPacket &request);
@@ -83,9 +105,11 @@ class Server {
         ResponsePacket close_session(const RequestPacket &request);
         ResponsePacket get_storage_ids(const RequestPacket &request);
         ResponsePacket get_storage_info(const RequestPacket &request);
+        ResponsePacket get_num_objects(const RequestPacket &request);
         ResponsePacket get_object_handles(const RequestPacket &request);
         ResponsePacket get_object_info(const RequestPacket &request);
         ResponsePacket get_object(const RequestPacket &request);
+        ResponsePacket get_thumb(const RequestPacket &request);
         ResponsePacket delete_object(const RequestPacket &request);
         ResponsePacket send_object_info(const RequestPacket &request);
         ResponsePacket send_object(const RequestPacket &request);
@@ -100,12 +124,29 @@ class Server {
         ResponsePacket set_object_prop_value(const RequestPacket &request);
         ResponsePacket get_object_prop_list(const RequestPacket &request);
 
+        // Vendor extensions
+        ResponsePacket get_object_info_list(const RequestPacket &request);
+        ResponsePacket get_object_tree(const RequestPacket &request);
+        ResponsePacket get_object_changes(const RequestPacket &request);
+        ResponsePacket search_objects(const RequestPacket &request);
+        ResponsePacket get_search_results(const RequestPacket &request);
+        ResponsePacket get_object_handles_paged(const RequestPacket &request);
+        ResponsePacket get_object_archive(const RequestPacket &request);
+        ResponsePacket send_object_archive(const RequestPacket &request);
+        ResponsePacket get_object_signatures(const RequestPacket &request);
+        ResponsePacket send_object_delta(const RequestPacket &request);
+        ResponsePacket get_object_compressed(const RequestPacket &request);
+        ResponsePacket send_object_compressed(const RequestPacket &request);
+        ResponsePacket get_commit_stats(const RequestPacket &request);
+
     private:
-        StorageManager storage_manager;
+        StorageManager &storage_manager;
 
         Storage *last_sent_storage;
         Object  *last_sent_object;
 
+        std::vector<Object::Handle> search_results;
+
         std::atomic_bool session_opened = false;
 };
 
@@ -1,10 +1,27 @@
+#include <algorithm>
+#include <ctime>
+#include <memory>
+
+#include "copy_engine.hpp"
+#include "mtp_formats.hpp"
+#include "mtp_media.hpp"
 #include "mtp_object.hpp"
 #include "mtp_packet.hpp"
+#include "mtp_properties.hpp"
 #include "mtp_storage.hpp"
+#include "mtp_thumbnails.hpp"
 #include "mtp_types.hpp"
+#include "tar.hpp"
 
 namespace nq::mtp {
 
+// Logs every tenth of a transfer, long copies are otherwise silent
+static void log_progress(std::uint64_t done, std::uint64_t total) {
+    auto prev = (done > fs::CopyEngine::buffer_size) ? done - fs::CopyEngine::buffer_size : 0;
+    if ((done == total) || (done * 10 / total != prev * 10 / total))
+        INFO("Copied %#lx/%#lx bytes (%lu%%)\n", done, total, done * 100 / total);
+}
+
 ObjectInfo::ObjectInfo(DataPacket &packet) {
     this->storage_id        = packet.pop<StorageId>();
     this->format            = packet.pop<ObjectFormatCode>();
@@ -41,20 +58,189 @@ void ObjectInfo::push_to(DataPacket &packet) {
 
 Storage::Storage(const fs::Filesystem &fs, StorageId id, const StorageInfo &storage_info):
         fs(fs), id(id), storage_info(storage_info) {
-    // Register root object
-    Object root_obj;
-    root_obj.handle = root_handle;
-    root_obj.format = ObjectFormatCode::Association;
-    root_obj.name   = u"";
-    root_obj.path   = "/";
-    root_obj.size   = 0;
-    this->known_paths[root_obj.path] = root_handle;
-    this->objects[root_handle] = std::move(root_obj);
+    // Register root object, always at index 0
+    auto &root  = this->objects[this->objects.allocate()];
+    root.handle = root_handle;
+    root.format = ObjectFormatCode::Association;
+    this->directories[0] = {};
+
+    // Local handle 0 is never handed out
+    this->handles.push_back(Object::invalid_index);
+
+    // Only needs to differ between runs, nonzero so that it never matches an unset token
+    this->journal_id = static_cast<std::uint32_t>(armGetSystemTick()) | 1;
 
     update_storage_info();
 }
 
-std::vector<Object::Handle> Storage::cache_directory(Object *object, std::uint32_t depth, std::uint32_t cur_depth) {
+std::string Storage::get_path(const Object &object) const {
+    std::vector<const Object *> chain;
+    for (auto *obj = &object; obj->parent != Object::invalid_index; obj = &this->objects[obj->parent])
+        chain.push_back(obj);
+
+    std::string path = "/";
+    path.reserve(FS_MAX_PATH);
+    for (auto it = chain.rbegin(); it != chain.rend(); ++it) {
+        path += this->get_name(**it);
+        if ((*it)->is_directory())
+            path += '/';
+    }
+    return path;
+}
+
+std::string Storage::get_trash_path(Object::Handle handle) const {
+    char name[0x10];
+    std::snprintf(name, sizeof(name), "%08x", handle);
+    return "/" + std::string(trash_prefix) + name;
+}
+
+ObjectInfo Storage::make_object_info(const Object &object) const {
+    ObjectInfo info;
+    info.storage_id      = this->id;
+    info.format          = object.format;
+    info.compressed_size = object.size;
+    info.parent          = this->get_parent_handle(object);
+    info.filename        = std::string(this->get_name(object));
+    return info;
+}
+
+Object::Handle Storage::new_handle(Object::Index idx) {
+    auto local = static_cast<Object::Handle>(this->handles.size());
+    if (local <= handle_local_mask) {
+        this->handles.push_back(idx);
+        return this->handle_prefix | local;
+    }
+
+    // Handle space exhausted, fall back to recycling handles of freed objects
+    auto it = std::find(this->handles.begin() + 1, this->handles.end(), Object::invalid_index);
+    if (it == this->handles.end()) {
+        FATAL("Handle space exhausted for storage %#010x\n", this->id.id);
+        return 0;
+    }
+    *it = idx;
+    return this->handle_prefix | static_cast<Object::Handle>(it - this->handles.begin());
+}
+
+void Storage::set_name(Object &object, std::string_view name) {
+    this->names_garbage += object.name_size;
+    object.name      = this->names.size();
+    object.name_size = name.size();
+    this->names.insert(this->names.end(), name.begin(), name.end());
+}
+
+void Storage::compact_names() {
+    // Only worth it once most of the arena is made of names of freed/renamed objects
+    if ((this->names_garbage < 0x10000) || (this->names_garbage < this->names.size() / 2))
+        return;
+
+    std::vector<char> names;
+    names.reserve(this->names.size() - this->names_garbage);
+    for (Object::Index i = 0; i < this->objects.capacity(); ++i) {
+        auto &obj = this->objects[i];
+        if (obj.handle == 0)
+            continue;
+        auto name = this->get_name(obj);
+        obj.name  = names.size();
+        names.insert(names.end(), name.begin(), name.end());
+    }
+
+    TRACE("Compacted name arena from %#zx to %#zx bytes\n", this->names.size(), names.size());
+    this->names         = std::move(names);
+    this->names_garbage = 0;
+}
+
+Object *Storage::add_object(Object *parent, std::string_view name, ObjectFormatCode format, std::uint64_t size) {
+    auto parent_idx = this->index_of(*parent);
+    auto idx        = this->objects.allocate();
+
+    auto &obj  = this->objects[idx];
+    obj.format = format;
+    obj.size   = size;
+    obj.parent = parent_idx;
+    obj.handle = this->new_handle(idx);
+    this->set_name(obj, name);
+
+    if (obj.is_directory())
+        this->directories[idx] = {};
+    this->directories[parent_idx].children.push_back(idx);
+
+    if (formats::is_indexed(format))
+        this->format_index[format].insert(idx);
+
+    this->record_change(JournalOp::Created, obj);
+    return &obj;
+}
+
+void Storage::set_format(Object &object, ObjectFormatCode format) {
+    if (object.format == format)
+        return;
+
+    auto idx = this->index_of(object);
+    if (formats::is_indexed(object.format))
+        this->format_index[object.format].erase(idx);
+    if (formats::is_indexed(format))
+        this->format_index[format].insert(idx);
+    object.format = format;
+}
+
+ObjectFormatCode Storage::detect_format(const std::string &directory, std::string_view name, std::uint64_t size) {
+    if (auto format = formats::from_extension(name); format != ObjectFormatCode::Undefined)
+        return format;
+
+    // Files without an extension are identified through their magic, which costs a small read
+    if ((name.find('.') != std::string_view::npos) || (size < formats::magic_size))
+        return ObjectFormatCode::Undefined;
+
+    fs::File f;
+    R_TRY_RETURNV(this->fs.open_file(f, directory + std::string(name)), ObjectFormatCode::Undefined);
+    SCOPE_GUARD([&f] { f.close(); });
+
+    std::array<std::uint8_t, formats::magic_size> magic;
+    return formats::from_magic(magic.data(), f.read(magic.data(), magic.size()));
+}
+
+ResponseCode Storage::find_objects(std::vector<Object::Handle> &handles, ObjectFormatCode format, Object::Handle parent_handle) {
+    constexpr auto all_formats = static_cast<ObjectFormatCode>(0);
+
+    if (parent_handle != 0) {
+        auto *parent = this->find_handle(parent_handle);
+        TRY_RETURNV(parent && parent->is_directory(), ResponseCode::Invalid_ParentObject);
+
+        auto children = this->cache_directory(parent);
+        handles.reserve(handles.size() + children.size());
+        for (auto handle: children)
+            if ((format == all_formats) || (this->find_handle(handle)->format == format))
+                handles.push_back(handle);
+
+        this->prefetch_media(parent);
+        return ResponseCode::OK;
+    }
+
+    // Whole-storage queries need the full tree, walk it once per session then serve them from the index
+    if (!this->tree_cached) {
+        this->cache_directory(this->find_handle(root_handle), 0xffffffff);
+        this->tree_cached = true;
+    }
+
+    if (formats::is_indexed(format)) {
+        if (auto it = this->format_index.find(format); it != this->format_index.end()) {
+            handles.reserve(handles.size() + it->second.size());
+            for (auto idx: it->second)
+                handles.push_back(this->objects[idx].handle);
+        }
+        return ResponseCode::OK;
+    }
+
+    handles.reserve(handles.size() + this->objects.size());
+    for (Object::Index i = 1; i < this->objects.capacity(); ++i) {
+        auto &obj = this->objects[i];
+        if ((obj.handle != 0) && ((format == all_formats) || (obj.format == format)))
+            handles.push_back(obj.handle);
+    }
+    return ResponseCode::OK;
+}
+
+std::vector<Object::Handle> Storage::cache_directory(Object *object, std::uint32_t depth, bool unlisted_only) {
     std::vector<Object::Handle> handles;
 
     if (depth == 0) {
@@ -62,50 +248,243 @@ std::vector<Object::Handle> Storage::cache_directory(Object *object, std::uint32
         return handles;
     }
 
+    // Breadth-first walk, so that the directories of a level can be listed concurrently on the worker pool.
+    // Listings are merged into the index on this thread only, in bounded batches to cap memory usage
+    constexpr std::size_t batch_size = 64;
+
+    struct Listing {
+        std::string                   path;
+        std::vector<FsDirectoryEntry> entries;
+        Result                        rc;
+        bool                          skip;
+    };
+    std::vector<Listing> listings;
+
+    std::vector<Object::Index> level = { this->index_of(*object) }, next;
+    for (std::uint32_t cur_depth = 1; !level.empty(); ++cur_depth) {
+        next.clear();
+
+        for (std::size_t start = 0; start < level.size(); start += batch_size) {
+            auto count = std::min(batch_size, level.size() - start);
+            listings.resize(std::max(listings.size(), count));
+
+            for (std::size_t i = 0; i < count; ++i) {
+                auto idx = level[start + i];
+                listings[i].skip = unlisted_only && (this->directories[idx].session == this->session);
+                if (!listings[i].skip)
+                    listings[i].path = this->get_path(this->objects[idx]);
+            }
+
+            auto job = [this, &listings](std::size_t i) {
+                if (!listings[i].skip)
+                    listings[i].rc = this->list_directory(listings[i].path, listings[i].entries);
+            };
+
+            if (this->pool)
+                this->pool->parallel_for(count, job);
+            else
+                for (std::size_t i = 0; i < count; ++i)
+                    job(i);
+
+            for (std::size_t i = 0; i < count; ++i) {
+                auto idx = level[start + i];
+                if (!listings[i].skip && listings[i].rc.succeeded())
+                    this->update_directory(&this->objects[idx], listings[i].entries);
+
+                // Every level up to the requested depth is reported, not only the deepest one
+                for (auto child: this->directories[idx].children) {
+                    auto &obj = this->objects[child];
+                    handles.push_back(obj.handle);
+                    if (obj.is_directory() && (cur_depth < depth))
+                        next.push_back(child);
+                }
+            }
+        }
+
+        std::swap(level, next);
+    }
+
+    return handles;
+}
+
+Result Storage::list_directory(const std::string &path, std::vector<FsDirectoryEntry> &entries) {
     fs::Directory dir;
-    R_TRY_RETURNV(this->fs.open_directory(dir, object->path.c_str()), handles);
-    SCOPE_GUARD([&dir] { dir.close(); });
+    R_TRY_RETURN(this->fs.open_directory(dir, path));
+    auto rc = dir.list(entries);
+    dir.close();
+    return rc;
+}
 
-    auto entries = dir.list();
-    handles.reserve(entries.size());
+DirectoryDiff Storage::update_directory(Object *object) {
+    std::vector<FsDirectoryEntry> entries;
+    R_TRY_RETURNV(this->list_directory(this->get_path(*object), entries), {});
+    return this->update_directory(object, entries);
+}
+
+DirectoryDiff Storage::update_directory(Object *object, const std::vector<FsDirectoryEntry> &entries) {
+    DirectoryDiff diff;
 
+    // Compare the listing against the one the cached entries were built from
+    auto stamp = fnv1a(nullptr, 0);
+    std::size_t names_size = 0;
     for (auto &&entry: entries) {
-        Object::Handle handle;
-        auto path = object->path + entry.name;
-        if (auto obj = this->known_paths.find(path); obj != this->known_paths.end()) {
-            // Object was already cached, return existing handle
-            handle = obj->second;
-        } else {
-            // Object wasn't cached, register path + object
-            handle = Object::new_handle();
-            this->known_paths[path] = handle;
+        auto len = std::strlen(entry.name);
+        stamp = fnv1a(entry.name, len, stamp);
+        stamp = fnv1a(&entry.type, sizeof(entry.type), stamp);
+        stamp = fnv1a(&entry.file_size, sizeof(entry.file_size), stamp);
+        names_size += len;
+    }
+
+    auto &directory = this->get_directory(*object);
+    directory.session = this->session;
+    if (stamp == directory.stamp)
+        return diff;
+
+    // Names of the previous listing are looked up in place, the arena must not move until we're done
+    this->names.reserve(this->names.size() + names_size);
+
+    auto path = this->get_path(*object);
 
-            // Add slash terminator for directories
-            if (entry.type == FsDirEntryType_Dir)
-                path += '/';
+    std::unordered_map<std::string_view, Object::Index> previous;
+    previous.reserve(directory.children.size());
+    for (auto child: directory.children)
+        previous.emplace(this->get_name(this->objects[child]), child);
 
-            auto new_object = Object(entry, std::move(path), object);
+    for (auto &&entry: entries) {
+        auto name = std::string_view(entry.name);
+        if (name.empty())
+            continue;
 
-            this->objects[handle] = std::move(new_object);
+        // Trees pending deletion are hidden, leftovers from an interrupted run are deleted again
+        if ((object->handle == root_handle) && (name.substr(0, trash_prefix.size()) == trash_prefix)) {
+            if (this->worker)
+                this->purge_trash(path + std::string(name), 0);
+            continue;
         }
 
-        if (cur_depth == depth)
-            handles.push_back(handle);
+        if (auto it = previous.find(name); it != previous.end()) {
+            auto &cached = this->objects[it->second];
+            previous.erase(it);
 
-        if (cur_depth < depth) {
-            if (auto obj = this->objects[handle]; obj.is_directory()) {
-                auto o = this->cache_directory(&obj, depth, cur_depth + 1);
-                handles.reserve(handles.size() + o.size());
-                handles.insert(handles.end(), o.begin(), o.end());
+            if (cached.is_directory() == (entry.type == FsDirEntryType_Dir)) {
+                // Drop cached metadata of entries that were modified since
+                if (cached.is_file() && (cached.size != static_cast<std::uint64_t>(entry.file_size))) {
+                    cached.size = entry.file_size;
+                    cached.invalidate_timestamps();
+                    this->forget_contents(cached.handle);
+                    this->record_change(JournalOp::Modified, cached);
+                    diff.changed.push_back(cached.handle);
+                }
+                continue;
             }
+
+            // Entry was replaced by one of a different type, the old object is dead
+            diff.removed.push_back(cached.handle);
+            this->free_object(&cached);
         }
+
+        // Object wasn't cached, register it
+        auto format = Object::type(entry);
+        if (format != ObjectFormatCode::Association)
+            format = this->detect_format(path, name, entry.file_size);
+        diff.added.push_back(this->add_object(object, name, format, entry.file_size)->handle);
     }
 
-    return handles;
+    // Whatever is left from the previous listing no longer exists
+    for (auto &&[name, idx]: previous) {
+        diff.removed.push_back(this->objects[idx].handle);
+        this->free_object(&this->objects[idx]);
+    }
+
+    directory.stamp = stamp;
+
+    if (!diff.empty()) {
+        directory.generation = ++this->generation;
+        TRACE("Directory %s changed (+%zu, -%zu, ~%zu), generation %u\n", path.c_str(),
+            diff.added.size(), diff.removed.size(), diff.changed.size(), this->generation);
+
+        // Added objects are reported through the listing that discovered them
+        for (auto handle: diff.removed)
+            this->events.push_back({EventCode::ObjectRemoved, handle});
+        for (auto handle: diff.changed)
+            this->events.push_back({EventCode::ObjectInfoChanged, handle});
+    }
+
+    this->compact_names();
+
+    return diff;
+}
+
+void Storage::free_object(Object *object) {
+    if (object->handle == root_handle)
+        return;
+
+    this->record_change(JournalOp::Deleted, *object);
+
+    auto idx = this->index_of(*object);
+    if (auto *parent = this->get_parent(*object); parent) {
+        auto &siblings = this->get_directory(*parent).children;
+        siblings.erase(std::remove(siblings.begin(), siblings.end(), idx), siblings.end());
+    }
+
+    std::vector<Object::Index> dead = { idx };
+    while (!dead.empty()) {
+        auto i = dead.back();
+        dead.pop_back();
+
+        auto &obj = this->objects[i];
+        if (auto it = this->directories.find(i); it != this->directories.end()) {
+            dead.insert(dead.end(), it->second.children.begin(), it->second.children.end());
+            this->directories.erase(it);
+        }
+
+        if (formats::is_indexed(obj.format))
+            this->format_index[obj.format].erase(i);
+        this->forget_contents(obj.handle);
+
+        this->handles[obj.handle & handle_local_mask] = Object::invalid_index;
+        this->names_garbage += obj.name_size;
+        this->objects.free(i);
+    }
+}
+
+void Storage::relink_object(Object *object, Object *parent, std::string_view name) {
+    auto idx = this->index_of(*object), parent_idx = this->index_of(*parent);
+
+    if ((object->parent == parent_idx) && (name == this->get_name(*object)))
+        return;
+
+    if (object->parent != parent_idx) {
+        auto &siblings = this->directories[object->parent].children;
+        siblings.erase(std::remove(siblings.begin(), siblings.end(), idx), siblings.end());
+        this->directories[parent_idx].children.push_back(idx);
+        object->parent = parent_idx;
+    }
+
+    // Paths aren't stored, descendants need no update
+    if (name != this->get_name(*object)) {
+        this->set_name(*object, name);
+
+        // A new extension may change the format, keep formats sniffed from the contents otherwise
+        if (auto format = formats::from_extension(name); object->is_file() && (format != ObjectFormatCode::Undefined))
+            this->set_format(*object, format);
+    }
+
+    this->record_change(JournalOp::Moved, *object);
+}
+
+void Storage::fetch_timestamps(Object *object) {
+    if (object->has_timestamps())
+        return;
+
+    auto timestamp = this->fs.get_timestamp(this->get_path(*object));
+    object->created  = timestamp.created;
+    object->modified = timestamp.modified;
 }
 
 ResponseCode Storage::get_storage_info(DataPacket &packet) {
-    this->update_storage_info();
+    // Hosts poll this constantly, the filesystem is only queried in the background
+    this->refresh_free_space();
     packet.set_data(
         this->storage_info.storage_type, this->storage_info.filesystem_type,  this->storage_info.access_capability,
         this->storage_info.max_capacity, this->storage_info.free_space,       this->storage_info.free_space_objects,
@@ -114,23 +493,52 @@ ResponseCode Storage::get_storage_info(DataPacket &packet) {
     return ResponseCode::OK;
 }
 
-ResponseCode Storage::get_object_handles(DataPacket &packet, Object *object) {
-    TRACE("Listing directory %s\n", object->path.c_str());
-    packet.push(Array<Object::Handle>(this->cache_directory(object)));
-    return ResponseCode::OK;
+void Storage::refresh_free_space() {
+    if (this->free_space_refreshing || (std::chrono::steady_clock::now() - this->free_space_time < free_space_refresh_interval))
+        return;
+
+    if (!this->worker) {
+        this->storage_info.free_space = this->fs.free_space();
+        this->free_space_time         = std::chrono::steady_clock::now();
+        return;
+    }
+
+    // Computing free space is slow on exfat, the cached value is served meanwhile
+    this->free_space_refreshing = true;
+    this->free_space_pending    = 0;
+    auto free_space = std::make_shared<std::uint64_t>(0);
+    this->worker->push([this, free_space] {
+        *free_space = this->fs.free_space();
+    }, [this, free_space] {
+        this->free_space_refreshing   = false;
+        this->storage_info.free_space = *free_space;
+        this->free_space_time         = std::chrono::steady_clock::now();
+        this->adjust_free_space(this->free_space_pending);
+    });
 }
 
 ResponseCode Storage::get_object_info(DataPacket &packet, Object *object) {
-    TRACE("Getting infos for %s\n", object->path.c_str());
+    TRACE("Getting infos for %s\n", this->get_path(*object).c_str());
 
-    auto info = ObjectInfo(this->id, *object);
+    auto info = this->make_object_info(*object);
 
-    // Query timestamp
-    // TODO: Should be cached with object?
     if (object->is_file()) {
-        auto timestamp = this->fs.get_timestamp(object->path);
-        info.created  = timestamp.created;
-        info.modified = timestamp.modified;
+        this->fetch_timestamps(object);
+        info.created  = object->created;
+        info.modified = object->modified;
+    }
+
+    if (auto *meta = this->get_cached_media_info(object); meta) {
+        info.image_width  = meta->width;
+        info.image_height = meta->height;
+        info.image_depth  = meta->depth;
+    }
+
+    if (auto *thumb = this->get_cached_thumbnail(*object); thumb) {
+        info.thumbnail_format = thumb->format;
+        info.thumbnail_size   = thumb->data.size();
+        info.thumbnail_width  = thumb->width;
+        info.thumbnail_height = thumb->height;
     }
 
     info.push_to(packet);
@@ -138,115 +546,798 @@ ResponseCode Storage::get_object_info(DataPacket &packet, Object *object) {
 }
 
 ResponseCode Storage::get_object(DataPacket &packet, Object *object) {
-    TRACE("Getting object %s (size: %#x)\n", object->path.c_str(), object->size);
+    auto path = this->get_path(*object);
+    TRACE("Getting object %s (size: %#x)\n", path.c_str(), object->size);
     fs::File f;
-    R_TRY_RETURNV(this->fs.open_file(f, object->path), ResponseCode::Access_Denied);
+    R_TRY_RETURNV(this->fs.open_file(f, path), ResponseCode::Access_Denied);
     SCOPE_GUARD([&f]() { f.close(); });
-    R_TRY_RETURNV(packet.stream_from_file(f, object->size), ResponseCode::Incomplete_Transfer);
+
+    // Hash the data on its way out unless it's already known
+    fs::StreamHasher hasher;
+    auto it = this->content_ids.find(object->handle);
+    bool need_hash = this->hash_transfers && ((it == this->content_ids.end()) || !it->second.verified);
+    R_TRY_RETURNV(packet.stream_from_file(f, object->size, 0, need_hash ? &hasher : nullptr), ResponseCode::Incomplete_Transfer);
+    if (need_hash)
+        this->store_content_id(object, hasher);
     return ResponseCode::OK;
 }
 
-ResponseCode Storage::delete_object(Object *object) {
-    TRACE("Deleting object %s\n", object->path.c_str());
+ResponseCode Storage::get_object_archive(DataPacket &packet, Object *object) {
+    std::vector<Object *> objects;
+    if (object->handle != root_handle)
+        objects.push_back(object);
+    if (object->is_directory())
+        for (auto handle: this->cache_directory(object, 0xffffffff))
+            objects.push_back(this->find_handle(handle));
 
-    if (object->is_file())
-        R_TRY_RETURNV(this->fs.delete_file(object->path.c_str()), ResponseCode::Object_WriteProtected);
+    // Entries need modification times, query the missing ones concurrently
+    std::vector<Object *> missing;
+    for (auto *obj: objects)
+        if (obj->is_file() && !obj->has_timestamps())
+            missing.push_back(obj);
+
+    std::vector<std::string>    paths(missing.size());
+    std::vector<FsTimeStampRaw> timestamps(missing.size());
+    for (std::size_t i = 0; i < missing.size(); ++i)
+        paths[i] = this->get_path(*missing[i]);
+
+    auto fetch = [&](std::size_t i) { timestamps[i] = this->fs.get_timestamp(paths[i]); };
+    if (this->pool)
+        this->pool->parallel_for(missing.size(), fetch);
     else
-        R_TRY_RETURNV(this->fs.delete_directory(object->path.c_str()), ResponseCode::Object_WriteProtected);
+        for (std::size_t i = 0; i < missing.size(); ++i)
+            fetch(i);
+
+    for (std::size_t i = 0; i < missing.size(); ++i)
+        missing[i]->created = timestamps[i].created, missing[i]->modified = timestamps[i].modified;
+
+    // Names are relative to the parent, so that the archive unpacks to a directory of the same name
+    auto base = (object->handle == root_handle) ? std::string("/") : this->get_path(*this->get_parent(*object));
+    auto now  = static_cast<std::uint64_t>(std::time(nullptr));
+
+    fs::TarStream tar(this->fs);
+    for (auto *obj: objects) {
+        auto path = this->get_path(*obj);
+        auto name = path.substr(base.size());
+        if (obj->is_directory())
+            tar.add_directory(std::move(name), now);
+        else
+            tar.add_file(std::move(path), std::move(name), obj->size, obj->modified);
+    }
+
+    TRACE("Archiving %zu objects from %s (size %#lx)\n", objects.size(), this->get_path(*object).c_str(), tar.get_size());
+    R_TRY_RETURNV(packet.stream(tar.get_size(), [&tar](void *buf, std::size_t size) { return tar.read(buf, size); }),
+        ResponseCode::Incomplete_Transfer);
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::get_thumb(DataPacket &packet, Object *object) {
+    TRACE("Getting thumbnail of %s\n", this->get_path(*object).c_str());
+    auto *thumb = this->get_thumbnail(object);
+    TRY_RETURNV(thumb, ResponseCode::No_Thumbnail_Present);
+    packet.buffer = thumb->data;
+    return ResponseCode::OK;
+}
+
+const thumbs::Thumbnail *Storage::get_thumbnail(Object *object) {
+    if (!thumbs::is_supported(object->format))
+        return nullptr;
+
+    auto *thumb = this->thumbnails.find(object->handle);
+    if (!thumb) {
+        thumbs::Thumbnail t;
+        this->make_thumbnail(*object, t);
+        thumb = this->thumbnails.insert(object->handle, std::move(t));
+    }
+    return !thumb->empty() ? thumb : nullptr;
+}
+
+void Storage::make_thumbnail(const Object &object, thumbs::Thumbnail &thumb) {
+    auto path = this->get_path(object);
+    fs::File f;
+    R_TRY_RETURNV(this->fs.open_file(f, path), );
+    SCOPE_GUARD([&f] { f.close(); });
+
+    // Most cameras and the album embed a thumbnail in the EXIF data, which sits at the start of the file
+    auto buf = std::vector<std::uint8_t>(std::min<std::uint64_t>(object.size, thumbs::exif_search_size));
+    buf.resize(f.read(buf.data(), buf.size()));
+    if (thumbs::extract_exif(buf.data(), buf.size(), thumb))
+        return;
+
+    // Otherwise decode the whole picture
+    if (object.size > thumbs::max_decode_file_size)
+        return;
+    auto offset = buf.size();
+    buf.resize(object.size);
+    buf.resize(offset + f.read(buf.data() + offset, buf.size() - offset, offset));
+
+    if (auto rc = thumbs::generate(buf.data(), buf.size(), thumb); rc.failed()) {
+        TRACE("Failed to generate thumbnail for %s: %#x\n", path.c_str(), rc.code());
+        thumb = {};
+    }
+}
+
+void Storage::forget_contents(Object::Handle handle) {
+    this->thumbnails.erase(handle);
+    this->media_infos.erase(handle);
+    this->content_ids.erase(handle);
+}
+
+void Storage::store_content_id(Object *object, fs::StreamHasher &hasher) {
+    // Short transfers can't be told apart from a hash of the whole file
+    if (hasher.get_size() != object->size)
+        return;
+
+    fs::ContentHasher::Digest digest;
+    ContentId cid;
+    hasher.finish(digest, cid.crc32);
+    this->fetch_timestamps(object);
+    cid.size     = object->size;
+    cid.modified = object->modified;
+    cid.verified = true;
+    std::copy_n(digest.begin(), cid.id.size(), cid.id.begin());
+    this->content_ids[object->handle] = cid;
+}
+
+void Storage::compute_content_ids(const std::vector<Object *> &objects) {
+    fs::ContentHasher hasher(this->fs);
+    std::vector<std::pair<Object *, std::size_t>> pending;
+
+    for (auto *obj: objects) {
+        if (!obj->is_file())
+            continue;
+
+        if (auto it = this->content_ids.find(obj->handle); it != this->content_ids.end()) {
+            auto &cid = it->second;
+
+            // Files may have been changed from the console since the snapshot, check them once against the filesystem
+            if (!cid.verified) {
+                auto modified = static_cast<std::uint32_t>(this->fs.get_timestamp(this->get_path(*obj)).modified);
+                cid.verified = (cid.size == obj->size) && (cid.modified == modified);
+            }
+
+            if (cid.verified && (cid.size == obj->size))
+                continue;
+            this->content_ids.erase(it);
+        }
+
+        this->fetch_timestamps(obj);
+        pending.emplace_back(obj, hasher.add_file(this->get_path(*obj), obj->size));
+    }
+
+    if (hasher.empty())
+        return;
+
+    TRACE("Hashing %zu files\n", pending.size());
+    hasher.run(this->pool);
+
+    for (auto &&[obj, idx]: pending) {
+        fs::ContentHasher::Digest digest;
+        ContentId cid;
+        R_TRY(hasher.get_result(idx, digest, cid.crc32), continue);
+
+        cid.size     = obj->size;
+        cid.modified = obj->modified;
+        cid.verified = true;
+        std::copy_n(digest.begin(), cid.id.size(), cid.id.begin());
+        this->content_ids[obj->handle] = cid;
+    }
+}
+
+const ContentId *Storage::get_content_id(Object *object) {
+    this->compute_content_ids({ object });
+    auto it = this->content_ids.find(object->handle);
+    return (it != this->content_ids.end()) ? &it->second : nullptr;
+}
+
+const media::MediaInfo *Storage::get_media_info(Object *object) {
+    if (!media::is_supported(object->format))
+        return nullptr;
+
+    if (auto it = this->media_infos.find(object->handle); it != this->media_infos.end())
+        return &it->second;
+
+    // Failures are cached too, as zeroed infos
+    media::MediaInfo info;
+    fs::File f;
+    if (this->fs.open_file(f, this->get_path(*object)).succeeded()) {
+        media::parse(f, object->size, object->format, info);
+        f.close();
+    }
+    return &this->media_infos.emplace(object->handle, info).first->second;
+}
+
+const media::MediaInfo *Storage::get_cached_media_info(Object *object) {
+    if (!media::is_supported(object->format))
+        return nullptr;
+
+    if (auto it = this->media_infos.find(object->handle); it != this->media_infos.end())
+        return &it->second;
+
+    this->prefetch_media(std::vector{ object });
+    return nullptr;
+}
+
+void Storage::prefetch_media(Object *directory) {
+    if (!this->worker)
+        return;
+
+    auto &children = this->get_directory(*directory).children;
+    std::vector<Object *> objects;
+    objects.reserve(children.size());
+    for (auto child: children)
+        objects.push_back(&this->objects[child]);
+    this->prefetch_media(objects);
+}
+
+void Storage::prefetch_media(const std::vector<Object *> &objects) {
+    if (!this->worker)
+        return;
+
+    struct Entry {
+        Object::Handle    handle;
+        ObjectFormatCode  format;
+        std::uint64_t     size;
+        std::string       path;
+        bool              want_info, want_thumb;
+        media::MediaInfo  info;
+        thumbs::Thumbnail thumb;
+    };
+
+    auto entries = std::make_shared<std::vector<Entry>>();
+    for (auto *object: objects) {
+        auto &obj = *object;
+        if (this->media_pending.count(obj.handle))
+            continue;
+
+        // Only embedded thumbnails are extracted here, decoding is left to GetThumb
+        bool want_info  = media::is_supported(obj.format) && !this->media_infos.count(obj.handle);
+        bool want_thumb = thumbs::is_supported(obj.format) && !this->thumbnails.find(obj.handle);
+        if (!want_info && !want_thumb)
+            continue;
 
+        entries->push_back({ obj.handle, obj.format, obj.size, this->get_path(obj),
+            want_info, want_thumb, {}, {} });
+        this->media_pending.insert(obj.handle);
+    }
+
+    if (entries->empty())
+        return;
+
+    TRACE("Prefetching media infos of %zu objects\n", entries->size());
+    this->worker->push([this, entries] {
+        std::vector<std::uint8_t> buf;
+        for (auto &&entry: *entries) {
+            fs::File f;
+            if (this->fs.open_file(f, entry.path).failed())
+                continue;
+            SCOPE_GUARD([&f] { f.close(); });
+
+            if (entry.want_info)
+                media::parse(f, entry.size, entry.format, entry.info);
+
+            if (entry.want_thumb) {
+                buf.resize(std::min<std::uint64_t>(entry.size, thumbs::exif_search_size));
+                buf.resize(f.read(buf.data(), buf.size()));
+                if (!thumbs::extract_exif(buf.data(), buf.size(), entry.thumb))
+                    entry.thumb = {};
+            }
+        }
+    }, [this, entries] {
+        for (auto &&entry: *entries) {
+            this->media_pending.erase(entry.handle);
+
+            // Objects may have been deleted or rewritten in the meantime
+            auto *obj = this->find_handle(entry.handle);
+            if (!obj || (obj->format != entry.format) || (obj->size != entry.size))
+                continue;
+
+            if (entry.want_info)
+                this->media_infos.emplace(entry.handle, entry.info);
+
+            // Misses aren't cached, the picture may still be decoded by GetThumb
+            if (entry.want_thumb && !entry.thumb.empty() && !this->thumbnails.find(entry.handle))
+                this->thumbnails.insert(entry.handle, std::move(entry.thumb));
+        }
+    });
+}
+
+void Storage::close_paged_listing(const Object *object) {
+    auto *listing = this->paged_listing.get();
+    if (!listing)
+        return;
+
+    if (object) {
+        auto idx = listing->directory;
+        while ((idx != Object::invalid_index) && (&this->objects[idx] != object))
+            idx = this->objects[idx].parent;
+        if (idx == Object::invalid_index)
+            return;
+    }
+
+    TRACE("Closing paged listing of %s\n", this->get_path(this->objects[listing->directory]).c_str());
+    this->paged_listing.reset();
+}
+
+ResponseCode Storage::delete_object(Object *object) {
+    TRY_RETURNV(object->handle != root_handle, ResponseCode::Object_WriteProtected);
+
+    auto path   = this->get_path(*object);
+    auto handle = object->handle;
+    TRACE("Deleting object %s\n", path.c_str());
+
+    this->close_paged_listing(object);
+    auto write = this->begin_write();
+
+    if (object->is_file()) {
+        R_TRY_RETURNV(this->fs.delete_file(path), ResponseCode::Object_WriteProtected);
+        this->adjust_free_space(object->size);
+    } else if (auto trash = this->get_trash_path(handle); this->worker && this->fs.move_directory(path, trash).succeeded()) {
+        // Directory trees can take long to delete, move them out of the way and finish in the background.
+        // Completion is reported with an ObjectRemoved event
+        this->purge_trash(trash, handle);
+    } else {
+        R_TRY_RETURNV(this->fs.delete_directory(path), ResponseCode::Object_WriteProtected);
+        this->invalidate_free_space();
+    }
+
+    this->free_object(object);
     return ResponseCode::OK;
 }
 
+void Storage::purge_trash(const std::string &path, Object::Handle handle) {
+    if (!this->pending_trash.insert(path).second)
+        return;
+
+    this->worker->push([this, path, &committer = this->get_committer()] {
+        fs::CommitScheduler::Write write(committer);
+        R_TRY_LOG(this->fs.delete_directory(path));
+    }, [this, path, handle] {
+        TRACE("Finished deleting %s\n", path.c_str());
+        this->pending_trash.erase(path);
+        this->invalidate_free_space();
+        if (handle)
+            this->events.push_back({EventCode::ObjectRemoved, handle});
+    });
+}
+
 ResponseCode Storage::send_object_info(DataPacket &packet, Object::Handle parent_handle, Object **out_obj) {
-    auto  info        = ObjectInfo(packet);
-    auto &parent      = this->objects[parent_handle];
-    auto  destination = parent.path + to_utf8(info.filename.chars);
+    auto  info   = ObjectInfo(packet);
+    auto *parent = this->find_handle(parent_handle);
+    TRY_RETURNV(parent && parent->is_directory(), ResponseCode::Invalid_ParentObject);
 
-    Object::new_handle();
-    auto obj = Object(info, std::move(destination), parent);
+    auto name        = to_utf8(info.filename.chars);
+    auto destination = this->get_path(*parent) + name;
 
-    if (obj.is_file())
-        R_TRY_LOG(this->fs.create_file(obj.path, obj.size));
-    else
-        R_TRY_LOG(this->fs.create_directory(obj.path));
+    // Hosts usually leave the format undefined
+    if (info.format == ObjectFormatCode::Undefined)
+        info.format = formats::from_extension(name);
 
-    TRACE("Adding object %s (type %d, size %#lx)\n", obj.path.c_str(), obj.type, obj.size);
-    this->known_paths[obj.path] = obj.handle;
+    auto write = this->begin_write();
+    if (info.format != ObjectFormatCode::Association) {
+        R_TRY_RETURNV(this->fs.create_file(destination, info.compressed_size), ResponseCode::Access_Denied);
+        this->adjust_free_space(-static_cast<std::int64_t>(info.compressed_size));
+    } else {
+        R_TRY_RETURNV(this->fs.create_directory(destination), ResponseCode::Access_Denied);
+    }
 
-    if (info.format == ObjectFormatCode::Association)
-        obj.path += '/';
-    *out_obj = &this->objects.insert_or_assign(obj.handle, std::move(obj)).first->second;
+    TRACE("Adding object %s (type %#x, size %#lx)\n", destination.c_str(), info.format, info.compressed_size);
+    *out_obj = this->add_object(parent, name, info.format, info.compressed_size);
 
     return ResponseCode::OK;
 }
 
 ResponseCode Storage::send_object(DataPacket &packet, Object *object) {
-    TRACE("Sending object %s (size: %#x)\n", object->path.c_str(), object->size);
+    auto path = this->get_path(*object);
+    TRACE("Sending object %s (size: %#x)\n", path.c_str(), object->size);
+    auto write = this->begin_write(object->size);
+    fs::File f;
+    R_TRY_RETURNV(this->fs.open_file(f, path, FsOpenMode_Write), ResponseCode::Access_Denied);
+    SCOPE_GUARD([&f]() { f.close(); });
+    fs::StreamHasher hasher;
+    auto rc = packet.stream_to_file(f, object->size, 0, this->hash_transfers ? &hasher : nullptr);
+
+    // Contents changed even when the transfer failed, but are only hashed if they all reached the disk
+    object->invalidate_timestamps();
+    this->forget_contents(object->handle);
+    this->record_change(JournalOp::Modified, *object);
+    R_TRY_RETURNV(rc, ResponseCode::Incomplete_Transfer);
+    if (this->hash_transfers)
+        this->store_content_id(object, hasher);
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::get_object_compressed(DataPacket &packet, Object *object) {
+    TRY_RETURNV(object->is_file(), ResponseCode::Invalid_ObjectFormatCode);
+
+    auto path = this->get_path(*object);
+    TRACE("Getting compressed object %s (size: %#lx)\n", path.c_str(), object->size);
+    fs::File f;
+    R_TRY_RETURNV(this->fs.open_file(f, path), ResponseCode::Access_Denied);
+    SCOPE_GUARD([&f]() { f.close(); });
+
+    fs::StreamHasher hasher;
+    auto it = this->content_ids.find(object->handle);
+    bool need_hash = this->hash_transfers && ((it == this->content_ids.end()) || !it->second.verified);
+
+    fs::FrameCompressor compressor(f, object->size, need_hash ? &hasher : nullptr);
+    R_TRY_RETURNV(compressor.start(), ResponseCode::General_Error);
+    R_TRY_RETURNV(packet.stream(DataPacket::unknown_size,
+        [&compressor](void *buf, std::size_t size) { return compressor.read(buf, size); }), ResponseCode::Incomplete_Transfer);
+    R_TRY_RETURNV(compressor.finish(), ResponseCode::Incomplete_Transfer);
+
+    TRACE("Sent %#lx bytes for %#lx\n", compressor.get_compressed_size(), object->size);
+    if (need_hash)
+        this->store_content_id(object, hasher);
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::send_object_compressed(DataPacket &packet, Object *object) {
+    auto path = this->get_path(*object);
+    TRACE("Sending compressed object %s (size: %#lx)\n", path.c_str(), object->size);
+    auto write = this->begin_write(object->size);
     fs::File f;
-    R_TRY_RETURNV(this->fs.open_file(f, object->path, FsOpenMode_Write), ResponseCode::Access_Denied);
+    if (this->fs.open_file(f, path, FsOpenMode_Write).failed()) {
+        packet.receive_stream(DataPacket::unknown_size, [](void *, std::size_t) { });
+        return ResponseCode::Access_Denied;
+    }
     SCOPE_GUARD([&f]() { f.close(); });
-    R_TRY_RETURNV(packet.stream_to_file(f, object->size), ResponseCode::Incomplete_Transfer);
+
+    fs::StreamHasher hasher;
+    fs::FrameDecompressor decompressor(f, object->size, this->hash_transfers ? &hasher : nullptr);
+    R_TRY_LOG(decompressor.start());
+
+    auto rc = packet.receive_stream(DataPacket::unknown_size,
+        [&decompressor](void *buf, std::size_t size) { decompressor.feed(buf, size); });
+    if (rc.succeeded())
+        rc = decompressor.finish();
+
+    // Same as send_object, contents changed even when the transfer failed
+    object->invalidate_timestamps();
+    this->forget_contents(object->handle);
+    this->record_change(JournalOp::Modified, *object);
+    R_TRY_RETURNV(rc, ResponseCode::Incomplete_Transfer);
+    if (this->hash_transfers)
+        this->store_content_id(object, hasher);
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::send_object_archive(DataPacket &packet, Object *object, std::uint32_t &nb_entries) {
+    // The data phase has to be consumed regardless
+    if (!object->is_directory()) {
+        packet.receive_stream(DataPacket::unknown_size, [](void *, std::size_t) { });
+        return ResponseCode::Invalid_ParentObject;
+    }
+
+    auto destination = this->get_path(*object);
+    TRACE("Unpacking archive to %s\n", destination.c_str());
+
+    // Existing entries are looked up by name, directories need an up-to-date listing for that
+    this->update_directory(object);
+
+    auto write = this->begin_write();
+
+    // Directories by relative path, and children by name built when a directory first receives an entry.
+    // The extractor reports parents before their contents
+    std::unordered_map<std::string, Object::Index> known_dirs = { { {}, this->index_of(*object) } };
+    std::unordered_map<Object::Index, std::unordered_map<std::string, Object::Index>> known_children;
+
+    // Lookups must not outlive the objects they point to
+    auto drop_freed = [&] {
+        for (auto it = known_dirs.begin(); it != known_dirs.end();)
+            it = (this->objects[it->second].handle == 0) ? known_dirs.erase(it) : std::next(it);
+        for (auto it = known_children.begin(); it != known_children.end();)
+            it = (this->objects[it->first].handle == 0) ? known_children.erase(it) : std::next(it);
+    };
+
+    auto register_entry = [&](std::string_view name, bool is_directory, std::uint64_t size) {
+        auto pos       = name.rfind('/');
+        auto dir_name  = std::string((pos == std::string_view::npos) ? std::string_view() : name.substr(0, pos));
+        auto base_name = std::string((pos == std::string_view::npos) ? name : name.substr(pos + 1));
+
+        auto dir_it = known_dirs.find(dir_name);
+        if (dir_it == known_dirs.end())
+            return;
+        auto parent_idx = dir_it->second;
+
+        auto [lookup, inserted] = known_children.try_emplace(parent_idx);
+        if (inserted)
+            for (auto child: this->directories[parent_idx].children)
+                lookup->second.emplace(this->get_name(this->objects[child]), child);
+
+        Object *obj = nullptr;
+        if (auto it = lookup->second.find(base_name); it != lookup->second.end()) {
+            auto *cached = &this->objects[it->second];
+            if (cached->is_directory() == is_directory) {
+                obj = cached;
+                if (cached->is_file()) {
+                    this->adjust_free_space(static_cast<std::int64_t>(cached->size) - static_cast<std::int64_t>(size));
+                    cached->size = size;
+                    cached->invalidate_timestamps();
+                    this->forget_contents(cached->handle);
+                    this->record_change(JournalOp::Modified, *cached);
+                    this->events.push_back({EventCode::ObjectInfoChanged, cached->handle});
+                } else {
+                    // The directory may hold files the archive overwrites
+                    this->update_directory(cached);
+                    drop_freed();
+                }
+            } else {
+                // The index was stale, the filesystem only lets entries be replaced by ones of the same type
+                this->events.push_back({EventCode::ObjectRemoved, cached->handle});
+                lookup->second.erase(it);
+                this->free_object(cached);
+                drop_freed();
+            }
+        }
+
+        if (!obj) {
+            auto format = is_directory ? ObjectFormatCode::Association :
+                this->detect_format(destination + dir_name + (dir_name.empty() ? "" : "/"), base_name, size);
+            obj = this->add_object(&this->objects[parent_idx], base_name, format, size);
+            if (auto it = known_children.find(parent_idx); it != known_children.end())
+                it->second.emplace(base_name, this->index_of(*obj));
+            if (!is_directory)
+                this->adjust_free_space(-static_cast<std::int64_t>(size));
+        }
+
+        if (is_directory)
+            known_dirs.emplace(name, this->index_of(*obj));
+        else
+            write.add_size(size);
+    };
+
+    fs::TarExtractor extractor(this->fs, destination, register_entry);
+    R_TRY_RETURNV(packet.receive_stream(DataPacket::unknown_size,
+        [&extractor](void *buf, std::size_t size) { extractor.feed(buf, size); }), ResponseCode::Incomplete_Transfer);
+
+    nb_entries = extractor.get_nb_entries();
+    TRACE("Unpacked %u entries to %s\n", nb_entries, destination.c_str());
+    R_TRY_RETURNV(extractor.finish(), ResponseCode::Incomplete_Transfer);
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::get_object_signatures(DataPacket &packet, Object *object, std::uint32_t block_size) {
+    TRY_RETURNV(object->is_file(), ResponseCode::Invalid_ObjectFormatCode);
+
+    if (block_size == 0)
+        block_size = fs::delta::default_block_size;
+    TRY_RETURNV((block_size >= fs::delta::min_block_size) && (block_size <= fs::delta::max_block_size),
+        ResponseCode::Invalid_Parameter);
+    while ((object->size / block_size >= fs::delta::max_blocks) && (block_size < fs::delta::max_block_size))
+        block_size *= 2;
+
+    auto path = this->get_path(*object);
+    TRACE("Computing signatures of %s (size %#lx, block size %#x)\n", path.c_str(), object->size, block_size);
+
+    std::vector<fs::delta::Signature> signatures;
+    R_TRY_RETURNV(fs::delta::compute_signatures(this->fs, path, object->size, block_size, this->pool, signatures),
+        ResponseCode::Access_Denied);
+
+    packet.buffer.reserve(packet.buffer.size() + 0x10 + signatures.size() * sizeof(fs::delta::Signature));
+    packet.push(block_size);
+    packet.push(static_cast<std::uint64_t>(object->size));
+    packet.push(static_cast<std::uint32_t>(signatures.size()));
+    auto *bytes = reinterpret_cast<const std::uint8_t *>(signatures.data());
+    packet.buffer.insert(packet.buffer.end(), bytes, bytes + signatures.size() * sizeof(fs::delta::Signature));
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::send_object_delta(DataPacket &packet, Object *object, std::uint64_t size) {
+    // The data phase has to be consumed regardless
+    auto discard = [&packet](ResponseCode code) {
+        packet.receive_stream(DataPacket::unknown_size, [](void *, std::size_t) { });
+        return code;
+    };
+
+    if (!object->is_file())
+        return discard(ResponseCode::Invalid_ObjectFormatCode);
+
+    // The new version is built in a hidden directory, purged on the next root listing if we get interrupted.
+    // Staging directories of earlier transfers may still be queued for deletion, they must not be reused
+    std::string staging;
+    do
+        staging = this->get_trash_path(object->handle) + '-' + std::to_string(++this->staging_serial);
+    while (this->pending_trash.count(staging));
+
+    auto path = this->get_path(*object);
+    auto temp = staging + "/new", backup = staging + "/old";
+    TRACE("Applying delta to %s (size %#lx -> %#lx)\n", path.c_str(), object->size, size);
+
+    auto write = this->begin_write(size);
+
+    // Leftovers of a previous session may use the same name
+    this->fs.delete_directory(staging);
+    if (this->fs.create_directory(staging).failed() || this->fs.create_file(temp, size).failed()) {
+        this->fs.delete_directory(staging);
+        return discard(ResponseCode::Store_Full);
+    }
+
+    fs::StreamHasher hasher;
+    bool received = false;
+    auto rc = [&] {
+        fs::File source, dest;
+        R_TRY_RETURN(this->fs.open_file(source, path));
+        SCOPE_GUARD([&source] { source.close(); });
+        R_TRY_RETURN(this->fs.open_file(dest, temp, FsOpenMode_Write));
+        SCOPE_GUARD([&dest] { dest.close(); });
+
+        fs::DeltaApplier applier(source, object->size, dest, size, this->hash_transfers ? &hasher : nullptr);
+        received = true;
+        R_TRY_RETURN(packet.receive_stream(DataPacket::unknown_size,
+            [&applier](void *buf, std::size_t size) { applier.feed(buf, size); }));
+        return applier.finish();
+    }();
+    if (!received)
+        discard(ResponseCode::OK);
+
+    // Swap the files, putting the old one back if the new one can't be moved in place
+    auto code = rc.succeeded() ? ResponseCode::OK : ResponseCode::Incomplete_Transfer;
+    if (rc.succeeded()) {
+        if (this->fs.move_file(path, backup).failed()) {
+            code = ResponseCode::Access_Denied;
+        } else if (this->fs.move_file(temp, path).failed()) {
+            this->fs.move_file(backup, path);
+            code = ResponseCode::Access_Denied;
+        }
+    }
+
+    if (this->worker)
+        this->purge_trash(staging, 0);
+    else
+        this->fs.delete_directory(staging);
+
+    if (code != ResponseCode::OK)
+        return code;
+
+    this->adjust_free_space(static_cast<std::int64_t>(object->size) - static_cast<std::int64_t>(size));
+    object->size = size;
+    object->invalidate_timestamps();
+    this->forget_contents(object->handle);
+    if (this->hash_transfers)
+        this->store_content_id(object, hasher);
+    this->record_change(JournalOp::Modified, *object);
     return ResponseCode::OK;
 }
 
-ResponseCode Storage::move_object(Object *object, Object::Handle parent_handle, Object::Handle &new_handle) {
-    auto old_path = std::move(object->path);
+ResponseCode Storage::move_object(Object *object, Storage &dest, Object::Handle parent_handle, Object::Handle &new_handle) {
+    // Renames can't cross filesystems, stream the data over then drop the source. Whether the source can be dropped
+    // is checked first, rather than after a possibly long copy. Failed copies are cleaned up by copy_object
+    if (&dest != this) {
+        TRY_RETURNV((object->handle != root_handle) && this->allows_deletion(), ResponseCode::Object_WriteProtected);
+        MTP_TRY_RETURN(this->copy_object(object, dest, parent_handle, new_handle));
+
+        auto source = this->get_path(*object);
+        TRACE("Removing source object %s\n", source.c_str());
+        this->close_paged_listing(object);
+        auto write = this->begin_write();
+        if (object->is_file()) {
+            R_TRY_RETURNV(this->fs.delete_file(source), ResponseCode::Partial_Deletion);
+            this->adjust_free_space(object->size);
+        } else {
+            R_TRY_RETURNV(this->fs.delete_directory(source), ResponseCode::Partial_Deletion);
+            this->invalidate_free_space();
+        }
+
+        this->free_object(object);
+        return ResponseCode::OK;
+    }
 
-    auto it = this->objects.find(parent_handle);
-    if (it == this->objects.end())
+    auto *parent = this->find_handle(parent_handle);
+    if (!parent)
         return ResponseCode::Invalid_ObjectHandle;
 
-    auto &parent = it->second;
-    object->path = parent.path + to_utf8(object->name.chars);
-    TRACE("Moving object %s to %s\n", old_path.c_str(), object->path.c_str());
+    auto name        = std::string(this->get_name(*object));
+    auto source      = this->get_path(*object);
+    auto destination = this->get_path(*parent) + name;
+    TRACE("Moving object %s to %s\n", source.c_str(), destination.c_str());
+    this->close_paged_listing(object);
+    auto write = this->begin_write();
 
     if (object->is_file())
-        R_TRY_RETURNV(this->fs.move_file(old_path, object->path), ResponseCode::General_Error);
+        R_TRY_RETURNV(this->fs.move_file(source, destination), ResponseCode::General_Error);
     else
-        R_TRY_RETURNV(this->fs.move_directory(old_path, object->path), ResponseCode::General_Error);
+        R_TRY_RETURNV(this->fs.move_directory(source, destination), ResponseCode::General_Error);
 
+    this->relink_object(object, parent, name);
     new_handle = object->handle;
 
     return ResponseCode::OK;
 }
 
-ResponseCode Storage::copy_object(Object *object, Object::Handle parent_handle, Object::Handle &new_handle) {
-    auto it = this->objects.find(parent_handle);
-    if (it == this->objects.end())
-        return ResponseCode::Invalid_ObjectHandle;
+ResponseCode Storage::copy_tree(fs::CopyEngine &engine, Object *object, Storage &dest, Object *dest_parent, Object **out_obj) {
+    struct Pending {
+        Object::Index source, dest_parent;
+    };
+    std::vector<Pending> pending = { { this->index_of(*object), dest.index_of(*dest_parent) } };
 
-    auto destination = it->second.path + to_utf8(object->name.chars);
-    TRACE("Copying object %s to %s\n", object->path.c_str(), destination.c_str());
+    *out_obj = nullptr;
+    while (!pending.empty()) {
+        auto [source_idx, parent_idx] = pending.back();
+        pending.pop_back();
 
-    auto new_object   = Object(*object);
-    new_object.handle = Object::new_handle();
-    new_object.path   = std::move(destination);
+        auto &source      = this->objects[source_idx];
+        auto  name        = std::string(this->get_name(source));
+        auto  source_path = this->get_path(source);
+        auto  dest_path   = dest.get_path(dest.objects[parent_idx]) + name;
 
-    if (new_object.is_file()) {
-        R_TRY_LOG(this->fs.create_file(new_object.path, new_object.size));
-        R_TRY_RETURNV(this->fs.copy_file(object->path, new_object.path), ResponseCode::Store_Not_Available);
-    } else {
-        R_TRY_LOG(this->fs.create_directory(new_object.path));
+        // Destination files are allocated upfront, their contents are streamed later by the engine
+        if (source.is_file()) {
+            R_TRY_RETURNV(dest.fs.create_file(dest_path, source.size), ResponseCode::Store_Not_Available);
+            dest.adjust_free_space(-static_cast<std::int64_t>(source.size));
+            engine.add_file(source_path, dest_path, source.size);
+        } else {
+            R_TRY_RETURNV(dest.fs.create_directory(dest_path), ResponseCode::Store_Not_Available);
+        }
+
+        TRACE("Adding object %s, type %#x, size %#lx\n", dest_path.c_str(), source.format, source.size);
+        auto *copy = dest.add_object(&dest.objects[parent_idx], name, source.format, source.size);
+        if (!*out_obj)
+            *out_obj = copy;
+
+        if (source.is_directory()) {
+            // Copy what the directory contains now, not what was cached
+            this->update_directory(&source);
+            for (auto child: this->directories[source_idx].children)
+                pending.push_back({ child, dest.index_of(*copy) });
+        }
     }
 
-    TRACE("Adding object %s, type %d, size %#lx\n", new_object.path.c_str(), new_object.type, new_object.size);
-    this->known_paths[new_object.path] = new_object.handle;
-    new_handle = this->objects.insert_or_assign(new_object.handle, std::move(new_object)).first->first;
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::copy_object(Object *object, Storage &dest, Object::Handle parent_handle, Object::Handle &new_handle) {
+    auto *parent = dest.find_handle(parent_handle);
+    if (!parent)
+        return ResponseCode::Invalid_ObjectHandle;
+    TRY_RETURNV(parent->is_directory(), ResponseCode::Invalid_ParentObject);
+
+    // A directory can't be copied into its own subtree
+    if (&dest == this)
+        for (auto *p = parent; p; p = this->get_parent(*p))
+            TRY_RETURNV(p != object, ResponseCode::Invalid_ParentObject);
+
+    TRACE("Copying object %s to %s on storage %#010x\n",
+        this->get_path(*object).c_str(), dest.get_path(*parent).c_str(), dest.id.id);
+
+    fs::CopyEngine engine(this->fs, dest.fs);
+    Object *copy = nullptr;
+    auto write = dest.begin_write();
+
+    // Files are allocated at full size before their contents are copied, a partial copy would be
+    // indistinguishable from a complete one and is removed entirely
+    auto code = this->copy_tree(engine, object, dest, parent, &copy);
+    if ((code == ResponseCode::OK) && engine.run(log_progress).failed())
+        code = ResponseCode::Incomplete_Transfer;
+
+    if (code != ResponseCode::OK) {
+        if (copy) {
+            auto path = dest.get_path(*copy);
+            TRACE("Removing partial copy %s\n", path.c_str());
+            R_TRY_LOG(copy->is_file() ? dest.fs.delete_file(path) : dest.fs.delete_directory(path));
+            dest.free_object(copy);
+        }
+        dest.adjust_free_space(engine.get_total_size());
+        return code;
+    }
 
+    new_handle = copy->handle;
+    write.add_size(engine.get_total_size());
     return ResponseCode::OK;
 }
 
 ResponseCode Storage::get_partial_object(DataPacket &packet, Object *object, std::size_t offset, std::size_t size) {
-    TRACE("Getting partial object %s (offset; %#x, size: %#x)\n", object->path.c_str(), offset, size);
+    auto path = this->get_path(*object);
+    TRACE("Getting partial object %s (offset; %#x, size: %#x)\n", path.c_str(), offset, size);
     fs::File f;
-    R_TRY_RETURNV(this->fs.open_file(f, object->path), ResponseCode::Access_Denied);
+    R_TRY_RETURNV(this->fs.open_file(f, path), ResponseCode::Access_Denied);
     SCOPE_GUARD([&f]() { f.close(); });
     R_TRY_RETURNV(packet.stream_from_file(f, size, offset), ResponseCode::Incomplete_Transfer);
     return ResponseCode::OK;
 }
 
 ResponseCode Storage::get_object_prop_value(DataPacket &packet, Object *object, ObjectPropertyCode property) {
-    TRACE("Getting prop value for object %s\n", object->path.c_str());
+    TRACE("Getting prop value for object %s\n", this->get_path(*object).c_str());
     switch (property) {
         case ObjectPropertyCode::StorageID:
             packet.push(this->id);
@@ -257,27 +1348,49 @@ ResponseCode Storage::get_object_prop_value(DataPacket &packet, Object *object,
         case ObjectPropertyCode::Object_Size:
             if (object->is_directory())
                 return ResponseCode::Invalid_ObjectPropCode;
-            packet.push(static_cast<std::uint64_t>(object->size));
+            packet.push(object->size);
             break;
         case ObjectPropertyCode::Object_File_Name:
-            packet.push(object->name);
+            packet.push(String(std::string(this->get_name(*object))));
             break;
         case ObjectPropertyCode::Date_Created:
             if (object->is_directory())
                 return ResponseCode::Invalid_ObjectPropCode;
-            packet.push(DateTime(this->fs.get_timestamp_created(object->path)));
+            this->fetch_timestamps(object);
+            packet.push(DateTime(object->created));
             break;
         case ObjectPropertyCode::Date_Modified:
             if (object->is_directory())
                 return ResponseCode::Invalid_ObjectPropCode;
-            packet.push(DateTime(this->fs.get_timestamp_modified(object->path)));
+            this->fetch_timestamps(object);
+            packet.push(DateTime(object->modified));
             break;
         case ObjectPropertyCode::Parent_Object:
-            if (object->handle == root_handle)
-                packet.push(0);
-            else
-                packet.push(object->parent->handle);
+            packet.push(this->get_parent_handle(*object));
             break;
+        case ObjectPropertyCode::Persistent_Unique_Object_Identifier:
+            packet.push(this->get_persistent_id(*object));
+            break;
+        case ObjectPropertyCode::Content_Hash:
+        case ObjectPropertyCode::Content_CRC32: {
+                if (object->is_directory())
+                    return ResponseCode::Invalid_ObjectPropCode;
+                auto *cid = this->get_content_id(object);
+                TRY_RETURNV(cid, ResponseCode::General_Error);
+                if (property == ObjectPropertyCode::Content_CRC32)
+                    packet.push(cid->crc32);
+                else
+                    packet.push(cid->id);
+            } break;
+        case ObjectPropertyCode::Width:
+        case ObjectPropertyCode::Height:
+        case ObjectPropertyCode::Duration: {
+                auto *meta = this->get_media_info(object);
+                if (!meta || ((property == ObjectPropertyCode::Duration) && !media::has_duration(object->format)))
+                    return ResponseCode::Invalid_ObjectPropCode;
+                packet.push((property == ObjectPropertyCode::Width)  ? meta->width :
+                            (property == ObjectPropertyCode::Height) ? meta->height : meta->duration);
+            } break;
         default:
             ERROR("Object prop value %#x not implemented\n", property);
             return ResponseCode::Invalid_ObjectPropCode;
@@ -286,18 +1399,26 @@ ResponseCode Storage::get_object_prop_value(DataPacket &packet, Object *object,
 }
 
 ResponseCode Storage::set_object_prop_value(DataPacket &packet, Object *object, ObjectPropertyCode property) {
-    TRACE("Setting prop value for object %s\n", object->path.c_str());
+    TRACE("Setting prop value for object %s\n", this->get_path(*object).c_str());
     switch (property) {
         case ObjectPropertyCode::Object_File_Name: {
-                auto old_path = std::move(object->path);
-                object->name  = packet.pop();
-                object->path  = object->parent->path + to_utf8(object->name.chars);
+                auto *parent = this->get_parent(*object);
+                if (!parent)
+                    return ResponseCode::Access_Denied;
+
+                auto name        = to_utf8(packet.pop().chars);
+                auto source      = this->get_path(*object);
+                auto destination = this->get_path(*parent) + name;
 
-                TRACE("Changing object name to %s\n", object->path.c_str());
+                TRACE("Changing object name to %s\n", destination.c_str());
+                this->close_paged_listing(object);
+                auto write = this->begin_write();
                 if (object->is_file())
-                    this->fs.move_file(old_path, object->path);
+                    R_TRY_RETURNV(this->fs.move_file(source, destination), ResponseCode::Access_Denied);
                 else
-                    this->fs.move_directory(old_path, object->path);
+                    R_TRY_RETURNV(this->fs.move_directory(source, destination), ResponseCode::Access_Denied);
+
+                this->relink_object(object, parent, name);
             } break;
         default:
             ERROR("Object prop value %#x not implemented\n", property);
@@ -306,28 +1427,54 @@ ResponseCode Storage::set_object_prop_value(DataPacket &packet, Object *object,
     return ResponseCode::OK;
 }
 
-ResponseCode Storage::get_object_prop_list(DataPacket &packet, Object *object,
-        ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t depth) {
+void Storage::get_object_prop_list(DataPacket &packet, const std::vector<Object::Handle> &handles,
+        ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t &nb_props) {
     constexpr auto all_props   = static_cast<ObjectPropertyCode>(0xffffffff);
     constexpr auto all_formats = static_cast<ObjectFormatCode>(0);
 
-    if (group_code)
-        return ResponseCode::Specification_By_Group_Unsupported;
+    // When a group is given, the property code is ignored
+    auto is_wanted = [&](ObjectPropertyCode property) {
+        if (group_code)
+            return props::obj::get_group(property) == group_code;
+        return (prop == all_props) || (prop == property);
+    };
 
-    auto handles = this->cache_directory(object, depth);
-    packet.buffer.reserve(0x10 * handles.size());
+    // Only request timestamps when needed, since they cost one fs query per object
+    bool need_timestamps = is_wanted(ObjectPropertyCode::Date_Created) || is_wanted(ObjectPropertyCode::Date_Modified);
+    bool need_media      = is_wanted(ObjectPropertyCode::Width) || is_wanted(ObjectPropertyCode::Height) ||
+        is_wanted(ObjectPropertyCode::Duration);
 
-    std::uint32_t nb_props = 0;
-    packet.push(0u); // Reserve nb props
+    // Hashing reads whole files, so content hashes are left out of all-properties queries and only served when asked for
+    bool need_content_ids = (prop == ObjectPropertyCode::Content_Hash) ||
+        (prop == ObjectPropertyCode::Content_CRC32) || (group_code == props::obj::group::content);
+    if (need_content_ids) {
+        std::vector<Object *> objects;
+        objects.reserve(handles.size());
+        for (auto &&handle: handles)
+            if (auto *obj = this->find_handle(handle); (format == all_formats) || (obj->format == format))
+                objects.push_back(obj);
+        this->compute_content_ids(objects);
+    }
+
+    packet.buffer.reserve(packet.buffer.size() + 0x10 * handles.size());
 
     for (auto &&handle: handles) {
-        auto &obj = this->objects[handle];
+        auto &obj = *this->find_handle(handle);
 
         if ((format != all_formats) && (obj.format != format))
             continue;
 
+        if (obj.is_file() && need_timestamps)
+            this->fetch_timestamps(&obj);
+
+        auto *meta = need_media ? this->get_media_info(&obj) : nullptr;
+
+        const ContentId *cid = nullptr;
+        if (auto it = this->content_ids.find(obj.handle); need_content_ids && (it != this->content_ids.end()))
+            cid = &it->second;
+
 #define PUSH_PROP(property, type, item, cond)                                           \
-    if ((cond) && ((prop == all_props) || (prop == ObjectPropertyCode::property))) {    \
+    if ((cond) && is_wanted(ObjectPropertyCode::property)) {                            \
         ++nb_props;                                                                     \
         packet.push(obj.handle);                                                        \
         packet.push(ObjectPropertyCode::property);                                      \
@@ -336,15 +1483,203 @@ ResponseCode Storage::get_object_prop_list(DataPacket &packet, Object *object,
     }
         PUSH_PROP(StorageID, UINT32, this->id, true);
         PUSH_PROP(Object_Format, UINT16, obj.format, true);
-        PUSH_PROP(Object_File_Name, STR, obj.name, true);
-        PUSH_PROP(Parent_Object, UINT32, obj.parent->handle, true);
+        PUSH_PROP(Object_File_Name, STR, String(std::string(this->get_name(obj))), true);
+        PUSH_PROP(Parent_Object, UINT32, this->get_parent_handle(obj), true);
         PUSH_PROP(Object_Size, UINT64, obj.size, obj.is_file());
-        PUSH_PROP(Date_Created, STR, DateTime(this->fs.get_timestamp_created(obj.path)), obj.is_file());
-        PUSH_PROP(Date_Modified, STR, DateTime(this->fs.get_timestamp_modified(obj.path)), obj.is_file());
+        PUSH_PROP(Date_Created, STR, DateTime(obj.created), obj.is_file());
+        PUSH_PROP(Date_Modified, STR, DateTime(obj.modified), obj.is_file());
+        PUSH_PROP(Width, UINT32, meta->width, meta);
+        PUSH_PROP(Height, UINT32, meta->height, meta);
+        PUSH_PROP(Duration, UINT32, meta->duration, meta && media::has_duration(obj.format));
+        PUSH_PROP(Persistent_Unique_Object_Identifier, UINT128, this->get_persistent_id(obj), true);
+        PUSH_PROP(Content_Hash, UINT128, cid->id, cid);
+        PUSH_PROP(Content_CRC32, UINT32, cid->crc32, cid);
 #undef PUSH_PROP
     }
+}
 
-    *reinterpret_cast<std::uint32_t *>(packet.buffer.begin().base()) = nb_props;
+ResponseCode Storage::find_objects_paged(Object *object, std::uint32_t offset, std::uint32_t limit,
+        std::vector<Object::Handle> &handles, std::uint32_t &total) {
+    TRY_RETURNV(object->is_directory(), ResponseCode::Invalid_ParentObject);
+    auto idx = this->index_of(*object);
+
+    // Pages are served from the enumeration in progress, unless the directory was changed through other operations
+    // since the last one. Starting over keeps the ordering stable, the filesystem returns entries in the same order
+    auto *listing = this->paged_listing.get();
+    bool restart = !listing || (listing->directory != idx) || (offset == 0) || (listing->seq < this->journal_base);
+    for (auto i = restart ? this->journal.size() : listing->seq - this->journal_base; i < this->journal.size(); ++i) {
+        auto &change = this->journal[i];
+        if ((change.parent == object->handle) || (change.handle == object->handle)) {
+            restart = true;
+            break;
+        }
+    }
+
+    if (restart) {
+        this->paged_listing.reset();
+        auto fresh = std::make_unique<PagedListing>();
+        R_TRY_RETURNV(this->fs.open_directory(fresh->dir, this->get_path(*object)), ResponseCode::Invalid_ParentObject);
+        this->paged_listing = std::move(fresh);
+
+        listing = this->paged_listing.get();
+        listing->directory = idx;
+        listing->reading   = true;
+        listing->total     = listing->dir.count();
+
+        // Names are copied, the arena may move as entries are added
+        for (auto child: this->directories[idx].children)
+            listing->known.emplace(this->get_name(this->objects[child]), child);
+    }
+
+    auto end = (limit == 0) ? std::numeric_limits<std::uint64_t>::max() : std::uint64_t(offset) + limit;
+    while (listing->reading && (listing->handles.size() < end)) {
+        auto start = listing->entries.size();
+        std::size_t nb_read = 0;
+        if (auto rc = listing->dir.read(listing->entries, PagedListing::read_batch, nb_read); rc.failed()) {
+            // Entries past this point are unknown, a partial listing must not be reconciled with the index
+            ERROR("Failed to read directory %s: %#x\n", this->get_path(*object).c_str(), rc.code());
+            this->paged_listing.reset();
+            return ResponseCode::General_Error;
+        }
+
+        if (nb_read == 0) {
+            // Listing complete, drop whatever it no longer contains from the index
+            listing->dir.close();
+            listing->reading = false;
+            this->update_directory(object, listing->entries);
+            this->prefetch_media(object);
+            break;
+        }
+
+        for (auto i = start; i < listing->entries.size(); ++i)
+            if (auto handle = this->index_paged_entry(*listing, object, listing->entries[i]); handle)
+                listing->handles.push_back(handle);
+    }
+
+    if (offset < listing->handles.size()) {
+        auto last = std::min<std::uint64_t>(end, listing->handles.size());
+        handles.insert(handles.end(), listing->handles.begin() + offset, listing->handles.begin() + last);
+    }
+
+    listing->seq = this->get_journal_seq();
+    total = listing->reading ? listing->total : listing->handles.size();
+    return ResponseCode::OK;
+}
+
+Object::Handle Storage::index_paged_entry(PagedListing &listing, Object *object, const FsDirectoryEntry &entry) {
+    auto name = std::string_view(entry.name);
+
+    // Trees pending deletion are hidden, update_directory takes care of them once the listing ends
+    if (name.empty() || ((object->handle == root_handle) && (name.substr(0, trash_prefix.size()) == trash_prefix)))
+        return 0;
+
+    if (auto it = listing.known.find(std::string(name)); it != listing.known.end()) {
+        auto &cached = this->objects[it->second];
+        if (cached.is_directory() == (entry.type == FsDirEntryType_Dir))
+            return cached.handle;
+
+        // Replaced by an entry of a different type
+        this->events.push_back({EventCode::ObjectRemoved, cached.handle});
+        this->free_object(&cached);
+    }
+
+    auto format = Object::type(entry);
+    if (format != ObjectFormatCode::Association)
+        format = this->detect_format(this->get_path(*object), name, entry.file_size);
+
+    auto *obj = this->add_object(object, name, format, entry.file_size);
+    listing.known[std::string(name)] = this->index_of(*obj);
+    return obj->handle;
+}
+
+ResponseCode Storage::search_objects(Object *object, std::string_view pattern, std::size_t max_results,
+        std::vector<Object::Handle> &handles) {
+    TRY_RETURNV(object->is_directory(), ResponseCode::Invalid_ParentObject);
+
+    // The index is assumed current for directories already listed this session, only the others are listed
+    if (!this->tree_cached) {
+        this->cache_directory(object, 0xffffffff, true);
+        if (object->handle == root_handle)
+            this->tree_cached = true;
+    }
+
+    std::vector<Object::Index> stack = { this->index_of(*object) };
+    while (!stack.empty()) {
+        auto idx = stack.back();
+        stack.pop_back();
+
+        for (auto child: this->directories[idx].children) {
+            auto &obj = this->objects[child];
+            if (glob_match(pattern, this->get_name(obj))) {
+                handles.push_back(obj.handle);
+                if (handles.size() >= max_results)
+                    return ResponseCode::OK;
+            }
+            if (obj.is_directory())
+                stack.push_back(child);
+        }
+    }
+
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::get_object_changes(DataPacket &packet, std::uint32_t journal_id, std::uint64_t seq) {
+    // Changes made from the console are only seen when directories are listed again, do it once per session
+    if (!this->tree_cached) {
+        this->cache_directory(this->find_handle(root_handle), 0xffffffff);
+        this->tree_cached = true;
+    }
+
+    auto last = this->get_journal_seq();
+    bool rescan = (journal_id != this->journal_id) || (seq < this->journal_base) || (seq > last);
+
+    packet.set_data(this->journal_id, last, static_cast<std::uint32_t>(rescan));
+    if (rescan) {
+        TRACE("Journal can't serve changes since %#x:%lu, current %#x:%lu\n", journal_id, seq, this->journal_id, last);
+        packet.push(0u);
+        return ResponseCode::OK;
+    }
+
+    auto first = this->journal.begin() + (seq - this->journal_base);
+    packet.buffer.reserve(packet.buffer.size() + sizeof(std::uint32_t) + sizeof(JournalEntry) * (last - seq));
+    packet.push(static_cast<std::uint32_t>(last - seq));
+    for (auto it = first; it != this->journal.end(); ++it)
+        packet.push(*it);
+
+    return ResponseCode::OK;
+}
+
+ResponseCode Storage::get_object_tree(DataPacket &packet, Object *object, std::uint32_t depth, bool with_timestamps) {
+    TRY_RETURNV(object->is_directory(), ResponseCode::Invalid_ParentObject);
+
+    // Listings are breadth-first, so directories are always met before their contents
+    auto handles = this->cache_directory(object, depth);
+    std::unordered_map<Object::Index, std::uint32_t> positions;
+
+    packet.buffer.reserve(packet.buffer.size() + sizeof(std::uint32_t) + (sizeof(TreeEntry) + 0x10) * handles.size());
+    packet.push(static_cast<std::uint32_t>(handles.size()));
+
+    for (std::uint32_t i = 0; i < handles.size(); ++i) {
+        auto &obj = *this->find_handle(handles[i]);
+        if (obj.is_file() && with_timestamps)
+            this->fetch_timestamps(&obj);
+
+        TreeEntry entry;
+        if (auto it = positions.find(obj.parent); it != positions.end())
+            entry.parent = it->second;
+        entry.handle    = obj.handle;
+        entry.size      = obj.size;
+        entry.modified  = obj.modified;
+        entry.format    = obj.format;
+        entry.name_size = obj.name_size;
+        packet.push(entry);
+
+        auto name = this->get_name(obj);
+        packet.buffer.insert(packet.buffer.end(), name.begin(), name.end());
+
+        if (obj.is_directory())
+            positions[this->index_of(obj)] = i;
+    }
 
     return ResponseCode::OK;
 }
@@ -368,6 +1703,127 @@ ResponseCode StorageManager::find_handle(Object::Handle handle, Storage **storag
     return ResponseCode::Invalid_ObjectHandle;
 }
 
+ResponseCode StorageManager::find_objects(StorageId id, ObjectFormatCode format, Object::Handle parent_handle,
+        std::vector<Object::Handle> &handles) {
+    if (id.id != all_storages) {
+        Storage *storage = nullptr;
+        MTP_TRY_RETURN(this->find_storage(id, &storage));
+        return storage->find_objects(handles, format, parent_handle);
+    }
+
+    // The root handle is shared by storages, only whole-device listings make sense across them
+    if ((parent_handle != 0) && (parent_handle != root_handle)) {
+        Storage *storage = nullptr; Object *object = nullptr;
+        MTP_TRY_RETURN(this->find_handle(parent_handle, &storage, &object));
+        return storage->find_objects(handles, format, parent_handle);
+    }
+
+    for (auto &&s: this->storages)
+        MTP_TRY_RETURN(s.second.find_objects(handles, format, parent_handle));
+    return ResponseCode::OK;
+}
+
+ResponseCode StorageManager::get_object_prop_list(DataPacket &packet, Object::Handle handle,
+        ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t depth) {
+    if (group_code && !props::obj::is_group_supported(group_code))
+        return ResponseCode::Specification_By_Group_Unsupported;
+
+    std::uint32_t nb_props = 0;
+    packet.push(0u); // Reserve nb props
+
+    if (handle == 0) {
+        // Null handle means all objects of the device, the depth is irrelevant then
+        for (auto &&s: this->storages) {
+            std::vector<Object::Handle> handles;
+            MTP_TRY_RETURN(s.second.find_objects(handles, format, 0));
+            s.second.get_object_prop_list(packet, handles, format, prop, group_code, nb_props);
+        }
+    } else {
+        Storage *storage = nullptr; Object *object = nullptr;
+        MTP_TRY_RETURN(this->find_handle(handle, &storage, &object));
+        storage->get_object_prop_list(packet, storage->cache_directory(object, depth), format, prop, group_code, nb_props);
+    }
+
+    *reinterpret_cast<std::uint32_t *>(packet.buffer.begin().base()) = nb_props;
+
+    return ResponseCode::OK;
+}
+
+ResponseCode StorageManager::search_objects(StorageId id, Object::Handle parent_handle, std::string_view pattern,
+        std::size_t max_results, std::vector<Object::Handle> &handles) {
+    if (id.id != all_storages) {
+        Storage *storage = nullptr;
+        MTP_TRY_RETURN(this->find_storage(id, &storage));
+
+        auto *object = storage->find_handle(parent_handle ? parent_handle : root_handle);
+        TRY_RETURNV(object, ResponseCode::Invalid_ObjectHandle);
+        return storage->search_objects(object, pattern, max_results, handles);
+    }
+
+    // As with listings, a subtree can only be searched on its own storage
+    if ((parent_handle != 0) && (parent_handle != root_handle)) {
+        Storage *storage = nullptr; Object *object = nullptr;
+        MTP_TRY_RETURN(this->find_handle(parent_handle, &storage, &object));
+        return storage->search_objects(object, pattern, max_results, handles);
+    }
+
+    for (auto &&s: this->storages) {
+        if (handles.size() >= max_results)
+            break;
+        MTP_TRY_RETURN(s.second.search_objects(s.second.find_handle(root_handle), pattern, max_results, handles));
+    }
+    return ResponseCode::OK;
+}
+
+std::string StorageManager::index_path(StorageId id) const {
+    char name[0x20];
+    std::snprintf(name, sizeof(name), "/index-%08x.bin", id.id);
+    return this->index_directory + name;
+}
+
+void StorageManager::load_indices() {
+    if (!this->index_fs.is_open())
+        return;
+
+    for (auto &&s: this->storages) {
+        if (s.second.is_index_loaded())
+            continue;
+        if (auto rc = s.second.load_index(this->index_fs, this->index_path(s.first)); rc.failed())
+            INFO("No usable index for storage %#010x (%#x)\n", s.first, rc.code());
+    }
+}
+
+void StorageManager::save_indices() {
+    if (!this->index_fs.is_open())
+        return;
+
+    this->index_fs.create_directory(this->index_directory);
+    for (auto &&s: this->storages) {
+        // Don't overwrite a snapshot that was never loaded with an empty index
+        if (s.second.is_index_loaded())
+            R_TRY_LOG(s.second.save_index(this->index_fs, this->index_path(s.first)));
+    }
+}
+
+void StorageManager::take_events(std::vector<StorageEvent> &events) {
+    for (auto &&s: this->storages)
+        s.second.take_events(events);
+}
+
+void StorageManager::commit_storages() {
+    for (auto &&[id, storage]: this->storages) {
+        storage.commit();
+
+        // Also served through GetCommitStats, logs only exist in debug builds
+        auto stats = storage.get_commit_stats();
+        if (stats.nb_commits || stats.nb_failures)
+            INFO("Storage %#010x: %u commits (%u failed) for %#lx bytes, latency avg %lu us, max %lu us\n",
+                id, stats.nb_commits, stats.nb_failures, stats.committed_size,
+                stats.nb_commits ? stats.total_latency.count() / stats.nb_commits / 1000 : 0,
+                stats.max_latency.count() / 1000);
+    }
+}
+
 ResponseCode StorageManager::get_storage_ids(DataPacket &packet) const {
     Array<StorageId> ids;
     for (auto &&s: this->storages)
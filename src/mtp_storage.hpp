@@ -1,20 +1,38 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <chrono>
 #include <cstdint>
+#include <cstring>
+#include <deque>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <switch.h>
 
+#include "commit_scheduler.hpp"
+#include "compressed_stream.hpp"
+#include "content_hasher.hpp"
+#include "mtp_media.hpp"
 #include "mtp_object.hpp"
 #include "mtp_packet.hpp"
+#include "mtp_thumbnails.hpp"
 #include "mtp_types.hpp"
+#include "copy_engine.hpp"
+#include "delta.hpp"
 #include "fs.hpp"
+#include "thread_pool.hpp"
+#include "work_queue.hpp"
 #include "utils.hpp"
 
 namespace nq::mtp {
 
-constexpr inline std::uint32_t root_handle = 0xffffffff;
+constexpr inline std::uint32_t root_handle  = 0xffffffff;
+constexpr inline std::uint32_t all_storages = 0xffffffff;
 
 struct StorageId {
     union {
@@ -70,73 +88,471 @@ struct ObjectInfo {
 
     ObjectInfo() = default;
     ObjectInfo(DataPacket &packet);
-    ObjectInfo(StorageId id, const Object &object):
-        storage_id(id), format(object.format), compressed_size(object.size), parent(object.parent->handle), filename(object.name) { }
 
     void push_to(DataPacket &packet);
 };
 
+// Result of re-listing a directory against the index
+struct DirectoryDiff {
+    std::vector<Object::Handle> added;
+    std::vector<Object::Handle> removed;
+    std::vector<Object::Handle> changed;
+
+    inline bool empty() const {
+        return this->added.empty() && this->removed.empty() && this->changed.empty();
+    }
+};
+
+// Hash of the file contents, served through the Content_Hash and Content_CRC32 vendor properties.
+// Persistent unique object identifiers don't depend on it, see get_persistent_id
+struct ContentId {
+    std::uint64_t                size     = 0; // File size and modification time the hash was computed at
+    std::uint32_t                modified = 0;
+    bool                         verified = false; // Unset for entries restored from an index snapshot
+    std::array<std::uint8_t, 16> id       = {};
+    std::uint32_t                crc32    = 0;
+};
+
+// Entry of the compact tree listing, followed by its utf-8 name. Parents are referred to by
+// their position in the listing, which always precedes their children
+struct TreeEntry {
+    std::uint32_t    parent    = 0xffffffff; // Unset for children of the listed directory
+    Object::Handle   handle    = 0;
+    std::uint64_t    size      = 0;
+    std::uint32_t    modified  = 0; // 0 when not known
+    ObjectFormatCode format    = ObjectFormatCode::Undefined;
+    std::uint16_t    name_size = 0;
+};
+ASSERT_SIZE(TreeEntry, 0x18);
+ASSERT_STANDARD_LAYOUT(TreeEntry);
+
+enum class JournalOp: std::uint16_t {
+    Created  = 1,
+    Deleted  = 2, // Descendants of deleted directories are not listed
+    Moved    = 3, // Renamed and/or reparented
+    Modified = 4, // Contents changed
+};
+
+struct JournalEntry {
+    Object::Handle handle   = 0;
+    Object::Handle parent   = 0; // Parent at the time of the change
+    JournalOp      op       = JournalOp::Created;
+    std::uint16_t  reserved = 0;
+};
+ASSERT_SIZE(JournalEntry, 0xc);
+ASSERT_STANDARD_LAYOUT(JournalEntry);
+
+struct StorageEvent {
+    EventCode      code   = EventCode::Undefined;
+    Object::Handle handle = 0;
+};
+
 struct Storage {
-    fs::Filesystem fs           = {};
-    StorageId      id           = 0;
-    StorageInfo    storage_info = {};
+    NON_COPYABLE(Storage);
+
+    // Handles carry the storage slot in their upper bits, the rest indexes the handle table
+    constexpr static std::uint32_t  handle_prefix_shift = 24;
+    constexpr static Object::Handle handle_local_mask   = (1 << handle_prefix_shift) - 1;
+
+    // Prefix of the root-level directories trees are moved to while they're being deleted
+    constexpr static std::string_view trash_prefix = ".nuqe-trash-";
+
+    // Index mutations kept for incremental syncs, older ones are dropped and hosts asking for them must rescan
+    constexpr static std::size_t journal_capacity = 0x4000;
+
+    // Free space is re-read at most this often, changes made through the server are accounted for in between
+    constexpr static auto free_space_refresh_interval = std::chrono::seconds(30);
+
+    fs::Filesystem fs             = {};
+    StorageId      id             = 0;
+    StorageInfo    storage_info   = {};
+    Object::Handle handle_prefix  = 0;
+    ThreadPool    *pool           = nullptr; // Shared by all storages, used for concurrent listings
+    WorkQueue     *worker         = nullptr; // Shared by all storages, used for background deletions
+    bool           hash_transfers = true;    // See StorageManager::set_transfer_hashing
 
     inline Storage() = default;
+    inline Storage(Storage &&) = default;
+    inline Storage &operator =(Storage &&) = default;
 
     Storage(const fs::Filesystem &fs, StorageId id, const StorageInfo &storage_info);
 
     inline ~Storage() {
+        // Pending writes are committed and open handles released before closing
+        this->paged_listing.reset();
+        this->committer.reset();
         this->fs.close();
     }
 
+    inline bool allows_deletion() const {
+        return (this->storage_info.access_capability == AccessCapability::ReadWrite) ||
+            (this->storage_info.access_capability == AccessCapability::ReadOnlyDeletion);
+    }
+
     inline void update_storage_info() {
         this->storage_info.free_space   = this->fs.free_space();
         this->storage_info.max_capacity = this->fs.total_space();
+        this->free_space_time           = std::chrono::steady_clock::now();
+    }
+
+    // Allocation granularity is ignored, periodic refreshes correct the drift. Changes made while a refresh
+    // is running are applied again on top of its result
+    inline void adjust_free_space(std::int64_t delta) {
+        if (this->free_space_refreshing)
+            this->free_space_pending += delta;
+        auto free_space = static_cast<std::int64_t>(this->storage_info.free_space) + delta;
+        this->storage_info.free_space = std::clamp<std::int64_t>(free_space, 0, this->storage_info.max_capacity);
+    }
+
+    // For changes of unknown size, such as deleted trees
+    inline void invalidate_free_space() {
+        this->free_space_time = {};
+    }
+
+    void refresh_free_space();
+
+    // Filesystem changes must happen within the scope of the returned object, so that they get committed
+    inline fs::CommitScheduler::Write begin_write(std::uint64_t size = 0) {
+        return fs::CommitScheduler::Write(this->get_committer(), size);
+    }
+
+    inline void commit() {
+        if (this->committer)
+            this->committer->commit();
+    }
+
+    inline fs::CommitScheduler::Stats get_commit_stats() {
+        return this->committer ? this->committer->get_stats() : fs::CommitScheduler::Stats{};
+    }
+
+    // Directories already listed this session are only walked when unlisted_only is set
+    std::vector<Object::Handle> cache_directory(Object *object, std::uint32_t depth = 1, bool unlisted_only = false);
+    DirectoryDiff update_directory(Object *object);
+    DirectoryDiff update_directory(Object *object, const std::vector<FsDirectoryEntry> &entries);
+    Result list_directory(const std::string &path, std::vector<FsDirectoryEntry> &entries);
+    void fetch_timestamps(Object *object);
+
+    Object *add_object(Object *parent, std::string_view name, ObjectFormatCode format, std::uint64_t size);
+    void set_format(Object &object, ObjectFormatCode format);
+    ObjectFormatCode detect_format(const std::string &directory, std::string_view name, std::uint64_t size);
+    void free_object(Object *object);
+    void relink_object(Object *object, Object *parent, std::string_view name);
+
+    inline std::uint32_t get_generation() const {
+        return this->generation;
+    }
+
+    inline void take_events(std::vector<StorageEvent> &events) {
+        events.insert(events.end(), this->events.begin(), this->events.end());
+        this->events.clear();
     }
 
-    std::vector<Object::Handle> cache_directory(Object *object, std::uint32_t depth = 1, std::uint32_t cur_depth = 1);
+    Result load_index(fs::Filesystem &fs, const std::string &path);
+    Result save_index(fs::Filesystem &fs, const std::string &path);
+
+    inline bool is_index_loaded() const {
+        return this->index_loaded;
+    }
+
+    // Files may have been changed from the console between sessions, whole-storage queries walk the tree again
+    inline void invalidate_tree() {
+        this->tree_cached = false;
+        ++this->session;
+    }
+
+    // The paged listing keeps its directory open, which prevents it and its parents from being removed or renamed.
+    // Without an object, the listing is dropped unconditionally
+    void close_paged_listing(const Object *object = nullptr);
 
     ResponseCode get_storage_info(DataPacket &packet);
-    ResponseCode get_object_handles(DataPacket &packet, Object *object);
+    // Parent handle 0 selects the whole storage, format 0 all formats
+    ResponseCode find_objects(std::vector<Object::Handle> &handles, ObjectFormatCode format, Object::Handle parent_handle);
     ResponseCode get_object_info(DataPacket &packet, Object *object);
     ResponseCode get_object(DataPacket &packet, Object *object);
+    ResponseCode get_thumb(DataPacket &packet, Object *object);
+    // Streams the object and its subtree as a tar archive, generated as the transfer goes
+    ResponseCode get_object_archive(DataPacket &packet, Object *object);
     ResponseCode delete_object(Object *object);
     ResponseCode send_object_info(DataPacket &packet, Object::Handle parent_handle, Object **out_obj);
     ResponseCode send_object(DataPacket &packet, Object *object);
-    ResponseCode move_object(Object *object, Object::Handle parent_handle, Object::Handle &new_handle);
-    ResponseCode copy_object(Object *object, Object::Handle parent_handle, Object::Handle &new_handle);
+    // Variants of get_object and send_object transferring compressed frames, (de)compressed on a worker thread.
+    // The compressed size isn't known upfront, the data phases end with a short transfer
+    ResponseCode get_object_compressed(DataPacket &packet, Object *object);
+    ResponseCode send_object_compressed(DataPacket &packet, Object *object);
+    // Unpacks a tar archive into a directory as it is received, entries that already exist are overwritten
+    ResponseCode send_object_archive(DataPacket &packet, Object *object, std::uint32_t &nb_entries);
+    // Block signatures for delta updates, the block size is raised for files that would have too many blocks
+    ResponseCode get_object_signatures(DataPacket &packet, Object *object, std::uint32_t block_size);
+    // Rebuilds the object from its current contents and a delta stream. The result is written to a new file,
+    // which replaces the old one only once complete
+    ResponseCode send_object_delta(DataPacket &packet, Object *object, std::uint64_t size);
+    // The destination storage may differ, in which case data is streamed between both filesystems
+    ResponseCode move_object(Object *object, Storage &dest, Object::Handle parent_handle, Object::Handle &new_handle);
+    ResponseCode copy_object(Object *object, Storage &dest, Object::Handle parent_handle, Object::Handle &new_handle);
+    // Recreates a tree under a directory of dest (possibly this storage), file contents are queued on the engine
+    ResponseCode copy_tree(fs::CopyEngine &engine, Object *object, Storage &dest, Object *dest_parent, Object **out_obj);
     ResponseCode get_partial_object(DataPacket &packet, Object *object, std::size_t offset, std::size_t size);
     ResponseCode get_object_prop_value(DataPacket &packet, Object *object, ObjectPropertyCode property);
     ResponseCode set_object_prop_value(DataPacket &packet, Object *object, ObjectPropertyCode property);
-    ResponseCode get_object_prop_list(DataPacket &packet, Object *object,
-        ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t depth);
+    void get_object_prop_list(DataPacket &packet, const std::vector<Object::Handle> &handles,
+        ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t &nb_props);
+    // Page of a directory listing, read from the filesystem only as far as needed. Stops with a short page, the total
+    // is the entry count reported by the filesystem
+    ResponseCode find_objects_paged(Object *object, std::uint32_t offset, std::uint32_t limit,
+        std::vector<Object::Handle> &handles, std::uint32_t &total);
+    // Matches names in the subtree against a wildcard pattern, directories that were never listed are listed first
+    ResponseCode search_objects(Object *object, std::string_view pattern, std::size_t max_results,
+        std::vector<Object::Handle> &handles);
+    // Changes recorded after the given sequence number. The journal id identifies this run, sequence numbers
+    // from another one are meaningless
+    ResponseCode get_object_changes(DataPacket &packet, std::uint32_t journal_id, std::uint64_t seq);
+    // Modification times are only reported when cached, unless fetching them is requested
+    ResponseCode get_object_tree(DataPacket &packet, Object *object, std::uint32_t depth, bool with_timestamps);
 
     inline Object *find_handle(Object::Handle handle) {
-        if (auto it = this->objects.find(handle); it != this->objects.end())
-            return &it->second;
+        if (handle == root_handle)
+            return &this->objects[0];
+        if ((handle & ~handle_local_mask) != this->handle_prefix)
+            return nullptr;
+        if (auto local = handle & handle_local_mask; local < this->handles.size())
+            if (auto idx = this->handles[local]; idx != Object::invalid_index)
+                return &this->objects[idx];
         return nullptr;
     }
 
+    inline Object::Index index_of(const Object &object) const {
+        return (object.handle == root_handle) ? 0 : this->handles[object.handle & handle_local_mask];
+    }
+
+    inline Object *get_parent(const Object &object) {
+        return (object.parent != Object::invalid_index) ? &this->objects[object.parent] : nullptr;
+    }
+
+    inline Object::Handle get_parent_handle(const Object &object) const {
+        return (object.parent != Object::invalid_index) ? this->objects[object.parent].handle : 0;
+    }
+
+    // Handles are persisted through index snapshots, so together with the storage id they identify
+    // an object across sessions, independently of its contents
+    inline std::array<std::uint8_t, 16> get_persistent_id(const Object &object) const {
+        std::array<std::uint8_t, 16> puoid = {};
+        std::memcpy(puoid.data(),     &this->id.id,   sizeof(this->id.id));
+        std::memcpy(puoid.data() + 4, &object.handle, sizeof(object.handle));
+        return puoid;
+    }
+
+    inline Directory &get_directory(const Object &object) {
+        return this->directories[this->index_of(object)];
+    }
+
+    inline std::string_view get_name(const Object &object) const {
+        return std::string_view(this->names.data() + object.name, object.name_size);
+    }
+
+    // Directory paths are terminated by a slash
+    std::string get_path(const Object &object) const;
+
+    ObjectInfo make_object_info(const Object &object) const;
+
+    // Returns nullptr for objects that have no thumbnail, results are cached. Pictures without an embedded thumbnail
+    // are decoded, which is slow enough that only GetThumb may do it
+    const thumbs::Thumbnail *get_thumbnail(Object *object);
+
+    // Never reads the file, for ObjectInfo which hosts request for every object they list
+    inline const thumbs::Thumbnail *get_cached_thumbnail(const Object &object) {
+        auto *thumb = this->thumbnails.find(object.handle);
+        return (thumb && !thumb->empty()) ? thumb : nullptr;
+    }
+
+    // Returns nullptr for non-media objects. Headers are parsed on the spot when not prefetched yet
+    const media::MediaInfo *get_media_info(Object *object);
+
+    // Never reads the file either, misses queue the parsing and are served as unknown until it completes
+    const media::MediaInfo *get_cached_media_info(Object *object);
+
+    // Queues header parsing and embedded thumbnail extraction for the media files of a directory, hosts usually
+    // query all of them after listing it
+    void prefetch_media(Object *directory);
+    void prefetch_media(const std::vector<Object *> &objects);
+
+    // Hashes files without an up-to-date content id, all at once so that the work is spread over the pool
+    void compute_content_ids(const std::vector<Object *> &objects);
+    const ContentId *get_content_id(Object *object);
+
+    std::string get_trash_path(Object::Handle handle) const;
+
+    private:
+        Object::Handle new_handle(Object::Index idx);
+        void set_name(Object &object, std::string_view name);
+        void compact_names();
+        void purge_trash(const std::string &path, Object::Handle handle);
+        void make_thumbnail(const Object &object, thumbs::Thumbnail &thumb);
+        void forget_contents(Object::Handle handle);
+
+        // Directory enumeration in progress for paged requests. Entries are indexed as they're read,
+        // and reconciled with the rest of the index once the listing ends
+        struct PagedListing {
+            NON_COPYABLE(PagedListing);
+            NON_MOVEABLE(PagedListing);
+
+            public:
+                constexpr static std::size_t read_batch = 0x100;
+
+                Object::Index                                  directory = Object::invalid_index;
+                fs::Directory                                  dir;
+                bool                                           reading   = false;
+                std::uint32_t                                  total     = 0;
+                std::uint64_t                                  seq       = 0; // Journal position of the last page
+                std::vector<FsDirectoryEntry>                  entries;
+                std::vector<Object::Handle>                    handles; // In listing order
+                std::unordered_map<std::string, Object::Index> known;
+
+                inline PagedListing() = default;
+
+                inline ~PagedListing() {
+                    if (this->reading)
+                        this->dir.close();
+                }
+        };
+
+        Object::Handle index_paged_entry(PagedListing &listing, Object *object, const FsDirectoryEntry &entry);
+
+        inline std::uint64_t get_journal_seq() const {
+            return this->journal_base + this->journal.size();
+        }
+
+        inline void record_change(JournalOp op, const Object &object) {
+            this->journal.push_back({ object.handle, this->get_parent_handle(object), op });
+            if (this->journal.size() > journal_capacity) {
+                this->journal.pop_front();
+                ++this->journal_base;
+            }
+        }
+
+        // Records the hashes computed while transferring a whole file
+        void store_content_id(Object *object, fs::StreamHasher &hasher);
+
+        // Created on first write, since most storages are never written to
+        inline fs::CommitScheduler &get_committer() {
+            if (!this->committer)
+                this->committer = std::make_unique<fs::CommitScheduler>(this->fs);
+            return *this->committer;
+        }
+
     private:
-        std::unordered_map<std::string, Object::Handle> known_paths;
-        std::unordered_map<Object::Handle, Object> objects;
+        ObjectArena                                  objects;
+        std::vector<Object::Index>                   handles;
+        std::unordered_map<Object::Index, Directory> directories;
+        std::vector<char>                            names;
+        std::size_t                                  names_garbage = 0;
+
+        std::unordered_map<ObjectFormatCode, std::unordered_set<Object::Index>> format_index;
+        bool                                                                    tree_cached = false;
+        std::uint32_t                                                           session     = 1;
+        std::unique_ptr<PagedListing>                                           paged_listing;
+
+        std::unordered_set<std::string> pending_trash;
+        std::uint32_t                   staging_serial = 0; // Makes staging directories unique across transfers
+
+        thumbs::Cache                                        thumbnails;
+        std::unordered_map<Object::Handle, media::MediaInfo> media_infos;
+        std::unordered_set<Object::Handle>                   media_pending;
+        std::unordered_map<Object::Handle, ContentId>        content_ids;
+
+        std::chrono::steady_clock::time_point free_space_time       = {};
+        bool                                  free_space_refreshing = false;
+        std::int64_t                          free_space_pending    = 0; // Adjustments made during the refresh
+
+        std::unique_ptr<fs::CommitScheduler> committer;
+
+        std::deque<JournalEntry> journal;
+        std::uint64_t            journal_base = 0; // Sequence number of the change preceding the first entry
+        std::uint32_t            journal_id   = 0;
+
+        std::vector<StorageEvent> events;
+        std::uint32_t generation   = 0;
+        bool          index_loaded = false;
 };
 
 class StorageManager {
     public:
+        constexpr static std::size_t enumeration_workers = 3;
+
         StorageManager() { }
 
         inline void add_storage(Storage &&storage) {
+            // Slots must be stable across runs for persisted handles, storages are always added in the same order
+            storage.handle_prefix  = (this->storages.size() + 1) << Storage::handle_prefix_shift;
+            storage.pool           = &this->pool;
+            storage.worker         = &this->worker;
+            storage.hash_transfers = this->hash_transfers;
             this->storages[storage.id] = std::move(storage);
         }
 
+        // Transfers hash the data they stream, so that content ids can be served without reading files again.
+        // This costs CPU time on every transfer, hosts that never query ids may prefer it disabled
+        inline void set_transfer_hashing(bool enabled) {
+            this->hash_transfers = enabled;
+            for (auto &&s: this->storages)
+                s.second.hash_transfers = enabled;
+        }
+
+        // Index snapshots are kept on a separate filesystem (the sd card), since most storages are read-only
+        inline void set_index_location(const fs::Filesystem &fs, const std::string &directory) {
+            this->index_fs        = fs;
+            this->index_directory = directory;
+        }
+
+        void load_indices();
+        void save_indices();
+
+        inline void invalidate_trees() {
+            for (auto &&s: this->storages)
+                s.second.invalidate_tree();
+        }
+
+        inline void close_paged_listings() {
+            for (auto &&s: this->storages)
+                s.second.close_paged_listing();
+        }
+
         ResponseCode find_storage(StorageId id, Storage **storage);
         ResponseCode find_handle(Object::Handle handle, Storage **storage, Object **object);
 
         ResponseCode get_storage_ids(DataPacket &packet) const;
 
+        ResponseCode find_objects(StorageId id, ObjectFormatCode format, Object::Handle parent_handle,
+            std::vector<Object::Handle> &handles);
+        ResponseCode get_object_prop_list(DataPacket &packet, Object::Handle handle,
+            ObjectFormatCode format, ObjectPropertyCode prop, std::uint32_t group_code, std::uint32_t depth);
+        ResponseCode search_objects(StorageId id, Object::Handle parent_handle, std::string_view pattern,
+            std::size_t max_results, std::vector<Object::Handle> &handles);
+
+        void take_events(std::vector<StorageEvent> &events);
+
+        // Commits pending writes of every storage, hosts expect data to be durable once the session ends
+        void commit_storages();
+
+        // Merges results of background jobs, must be called from the server thread
+        inline void poll_jobs() {
+            this->worker.poll();
+        }
+
+    private:
+        std::string index_path(StorageId id) const;
+
     private:
         std::unordered_map<std::uint32_t, Storage> storages;
+
+        // Listings are IPC-latency bound, so more workers than free cores still pay off
+        ThreadPool pool = ThreadPool(enumeration_workers);
+
+        // Declared after the storages, so that pending jobs complete before they are closed
+        WorkQueue worker;
+
+        bool           hash_transfers  = true;
+        fs::Filesystem index_fs        = {};
+        std::string    index_directory = {};
 };
 
 } // namespace nq::mtp
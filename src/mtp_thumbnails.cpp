@@ -0,0 +1,240 @@
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <switch.h>
+
+#include "mtp_thumbnails.hpp"
+
+namespace nq::mtp::thumbs {
+
+// caps:dc is only used as a fallback, thumbnails can still be extracted without it
+static bool decoder_available = false;
+
+Result initialize() {
+    R_TRY_RETURN(capsdcInitialize());
+    decoder_available = true;
+    return Result::success();
+}
+
+void finalize() {
+    if (decoder_available)
+        capsdcExit();
+    decoder_available = false;
+}
+
+static inline std::uint16_t read_u16(const std::uint8_t *p, bool big_endian) {
+    return big_endian ? (p[0] << 8) | p[1] : (p[1] << 8) | p[0];
+}
+
+static inline std::uint32_t read_u32(const std::uint8_t *p, bool big_endian) {
+    return big_endian ? (read_u16(p, true)  << 16) | read_u16(p + 2, true) :
+                        (read_u16(p + 2, false) << 16) | read_u16(p, false);
+}
+
+// Walks the marker segments preceding the image data, stops when the callback returns true
+template <typename F>
+static bool for_each_segment(const std::uint8_t *data, std::size_t size, F &&callback) {
+    if ((size < 4) || (data[0] != 0xff) || (data[1] != 0xd8))
+        return false;
+
+    for (std::size_t pos = 2; pos + 4 <= size;) {
+        if (data[pos] != 0xff)
+            return false;
+
+        // Markers may be preceded by fill bytes
+        auto marker = data[pos + 1];
+        if (marker == 0xff) {
+            ++pos;
+            continue;
+        }
+
+        // Start of scan or end of image, no more metadata after this point
+        if ((marker == 0xda) || (marker == 0xd9))
+            return false;
+
+        auto len = read_u16(data + pos + 2, true);
+        if ((len < 2) || (pos + 2 + len > size))
+            return false;
+
+        if (callback(marker, data + pos + 4, len - 2))
+            return true;
+        pos += 2 + len;
+    }
+    return false;
+}
+
+bool get_jpeg_dimensions(const std::uint8_t *data, std::size_t size, std::uint32_t &width, std::uint32_t &height) {
+    return for_each_segment(data, size, [&](std::uint8_t marker, const std::uint8_t *seg, std::size_t seg_size) {
+        // SOF0-15, except DHT, JPG and DAC which share the range
+        if ((marker < 0xc0) || (marker > 0xcf) || (marker == 0xc4) || (marker == 0xc8) || (marker == 0xcc))
+            return false;
+        if (seg_size < 5)
+            return false;
+        height = read_u16(seg + 1, true);
+        width  = read_u16(seg + 3, true);
+        return (width != 0) && (height != 0);
+    });
+}
+
+static bool parse_tiff(const std::uint8_t *tiff, std::size_t size, Thumbnail &thumb) {
+    if ((size < 8) || ((std::memcmp(tiff, "II", 2) != 0) && (std::memcmp(tiff, "MM", 2) != 0)))
+        return false;
+
+    bool big_endian = tiff[0] == 'M';
+    if (read_u16(tiff + 2, big_endian) != 42)
+        return false;
+
+    // Offsets and sizes are untrusted 32-bit values, bound checks are done in 64-bit so that they can't wrap.
+    // Returns the offset of the next IFD, or 0
+    auto next_ifd = [&](std::uint64_t offset) -> std::uint32_t {
+        if (offset + 2 > size)
+            return 0;
+        auto end = offset + 2 + read_u16(tiff + offset, big_endian) * 12;
+        return (end + 4 <= size) ? read_u32(tiff + end, big_endian) : 0;
+    };
+
+    // IFD1 describes the thumbnail image
+    auto ifd1 = next_ifd(read_u32(tiff + 4, big_endian));
+    if ((ifd1 == 0) || (static_cast<std::uint64_t>(ifd1) + 2 > size))
+        return false;
+
+    std::uint32_t thumb_offset = 0, thumb_size = 0;
+    auto nb_entries = read_u16(tiff + ifd1, big_endian);
+    for (std::uint32_t i = 0; i < nb_entries; ++i) {
+        auto entry_offset = static_cast<std::uint64_t>(ifd1) + 2 + i * 12;
+        if (entry_offset + 12 > size)
+            return false;
+        auto *entry = tiff + entry_offset;
+
+        // Values fit in the entry itself, shorts (type 3) are left-aligned
+        auto tag   = read_u16(entry, big_endian);
+        auto value = (read_u16(entry + 2, big_endian) == 3) ?
+            read_u16(entry + 8, big_endian) : read_u32(entry + 8, big_endian);
+
+        if (tag == 0x0201)
+            thumb_offset = value;
+        else if (tag == 0x0202)
+            thumb_size = value;
+    }
+
+    if ((thumb_offset == 0) || (thumb_size == 0) || (static_cast<std::uint64_t>(thumb_offset) + thumb_size > size))
+        return false;
+
+    if (!get_jpeg_dimensions(tiff + thumb_offset, thumb_size, thumb.width, thumb.height))
+        return false;
+
+    thumb.format = ObjectFormatCode::EXIF_JPEG;
+    thumb.data.assign(tiff + thumb_offset, tiff + thumb_offset + thumb_size);
+    return true;
+}
+
+bool extract_exif(const std::uint8_t *data, std::size_t size, Thumbnail &thumb) {
+    return for_each_segment(data, size, [&](std::uint8_t marker, const std::uint8_t *seg, std::size_t seg_size) {
+        constexpr std::string_view exif_magic = std::string_view("Exif\0\0", 6);
+        if ((marker != 0xe1) || (seg_size < exif_magic.size()) || std::memcmp(seg, exif_magic.data(), exif_magic.size()))
+            return false;
+        return parse_tiff(seg + exif_magic.size(), seg_size - exif_magic.size(), thumb);
+    });
+}
+
+Result generate(const std::uint8_t *data, std::size_t size, Thumbnail &thumb) {
+    TRY_RETURNV(decoder_available, Result::failure());
+
+    std::uint32_t width, height;
+    TRY_RETURNV(get_jpeg_dimensions(data, size, width, height), Result::failure());
+    TRY_RETURNV(width * height <= max_decode_pixels, Result::failure());
+
+    auto pixels = std::unique_ptr<std::uint8_t[]>(new (std::nothrow) std::uint8_t[width * height * 4]);
+    TRY_RETURNV(pixels != nullptr, Result::failure());
+
+    CapsScreenShotDecodeOption opts = {};
+    R_TRY_RETURN(capsdcDecodeJpeg(width, height, &opts, data, size, pixels.get(), width * height * 4));
+
+    // Integer box filter, good enough at these sizes
+    auto scale = std::max({ (width + max_width - 1) / max_width, (height + max_height - 1) / max_height, 1u });
+    thumb.width  = std::max(width  / scale, 1u);
+    thumb.height = std::max(height / scale, 1u);
+
+    // 24-bit bottom-up bitmap, rows are padded to 4 bytes
+    constexpr std::uint32_t headers_size = 14 + 40;
+    auto stride = (thumb.width * 3 + 3) & ~3u;
+    thumb.format = ObjectFormatCode::BMP;
+    thumb.data.assign(headers_size + stride * thumb.height, 0);
+
+    auto put = [&thumb](std::size_t offset, std::uint32_t value, std::size_t size) {
+        for (std::size_t i = 0; i < size; ++i)
+            thumb.data[offset + i] = value >> (8 * i);
+    };
+    put(0x00, 0x4d42, 2);                     // "BM"
+    put(0x02, thumb.data.size(), 4);
+    put(0x0a, headers_size, 4);
+    put(0x0e, 40, 4);                         // BITMAPINFOHEADER
+    put(0x12, thumb.width, 4);
+    put(0x16, thumb.height, 4);
+    put(0x1a, 1, 2);                          // Planes
+    put(0x1c, 24, 2);                         // Bits per pixel
+    put(0x22, stride * thumb.height, 4);
+
+    for (std::uint32_t y = 0; y < thumb.height; ++y) {
+        auto *row = thumb.data.data() + headers_size + (thumb.height - 1 - y) * stride;
+        for (std::uint32_t x = 0; x < thumb.width; ++x) {
+            // Blocks are clipped for pictures with extreme aspect ratios
+            std::uint32_t sum[3] = {}, count = 0;
+            for (std::uint32_t sy = y * scale; sy < std::min((y + 1) * scale, height); ++sy) {
+                for (std::uint32_t sx = x * scale; sx < std::min((x + 1) * scale, width); ++sx, ++count) {
+                    auto *src = pixels.get() + (sy * width + sx) * 4;
+                    sum[0] += src[0], sum[1] += src[1], sum[2] += src[2];
+                }
+            }
+
+            // RGBA to BGR
+            count = std::max(count, 1u);
+            row[x * 3 + 0] = sum[2] / count;
+            row[x * 3 + 1] = sum[1] / count;
+            row[x * 3 + 2] = sum[0] / count;
+        }
+    }
+
+    return Result::success();
+}
+
+const Thumbnail *Cache::find(Object::Handle handle) {
+    auto it = this->lookup.find(handle);
+    if (it == this->lookup.end())
+        return nullptr;
+
+    this->entries.splice(this->entries.begin(), this->entries, it->second);
+    return &it->second->second;
+}
+
+const Thumbnail *Cache::insert(Object::Handle handle, Thumbnail &&thumb) {
+    this->erase(handle);
+
+    this->size += cost(thumb);
+    this->entries.emplace_front(handle, std::move(thumb));
+    this->lookup[handle] = this->entries.begin();
+
+    // Never evict the entry just inserted, even if it's over budget on its own
+    while ((this->size > this->budget) && (this->entries.size() > 1)) {
+        auto &victim = this->entries.back();
+        this->size -= cost(victim.second);
+        this->lookup.erase(victim.first);
+        this->entries.pop_back();
+    }
+
+    return &this->entries.front().second;
+}
+
+void Cache::erase(Object::Handle handle) {
+    auto it = this->lookup.find(handle);
+    if (it == this->lookup.end())
+        return;
+
+    this->size -= cost(it->second->second);
+    this->entries.erase(it->second);
+    this->lookup.erase(it);
+}
+
+} // namespace nq::mtp::thumbs
@@ -0,0 +1,84 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+#include "mtp_codes.hpp"
+#include "mtp_object.hpp"
+#include "utils.hpp"
+
+namespace nq::mtp::thumbs {
+
+// Bounds of generated thumbnails, embedded ones are served as is
+constexpr inline std::uint32_t max_width  = 160;
+constexpr inline std::uint32_t max_height = 120;
+
+// EXIF data lives in an APP1 segment, which can't exceed 64KiB and comes right after the SOI marker
+constexpr inline std::size_t exif_search_size = 0x10000 + 0x20;
+
+// Pictures are decoded in memory to be downscaled, larger ones get no thumbnail
+constexpr inline std::size_t max_decode_file_size = 0x800000;
+constexpr inline std::size_t max_decode_pixels    = 1920 * 1080;
+
+struct Thumbnail {
+    ObjectFormatCode          format = ObjectFormatCode::Undefined;
+    std::uint32_t             width  = 0;
+    std::uint32_t             height = 0;
+    std::vector<std::uint8_t> data;
+
+    inline bool empty() const {
+        return this->data.empty();
+    }
+};
+
+// Only jpegs can be thumbnailed, through their EXIF data or the system decoder
+constexpr inline bool is_supported(ObjectFormatCode format) {
+    return (format == ObjectFormatCode::EXIF_JPEG) || (format == ObjectFormatCode::JFIF);
+}
+
+Result initialize();
+void finalize();
+
+// Reads the frame size from the first SOF marker
+bool get_jpeg_dimensions(const std::uint8_t *data, std::size_t size, std::uint32_t &width, std::uint32_t &height);
+
+// Copies the thumbnail embedded in the IFD1 of EXIF data (JPEGInterchangeFormat/Length tags)
+bool extract_exif(const std::uint8_t *data, std::size_t size, Thumbnail &thumb);
+
+// Decodes the whole picture and box-filters it down to a bmp
+Result generate(const std::uint8_t *data, std::size_t size, Thumbnail &thumb);
+
+// Least recently used thumbnails are evicted once the budget is exceeded.
+// Failed lookups are cached too (as empty thumbnails), so that pictures aren't parsed again on every request
+class Cache {
+    NON_COPYABLE(Cache);
+
+    public:
+        constexpr static std::size_t default_budget = 0x400000; // 4 MiB
+        constexpr static std::size_t entry_overhead = 0x40;     // Accounted for empty entries
+
+        inline Cache(std::size_t budget = default_budget): budget(budget) { }
+        inline Cache(Cache &&) = default;
+        inline Cache &operator =(Cache &&) = default;
+
+        const Thumbnail *find(Object::Handle handle);
+        const Thumbnail *insert(Object::Handle handle, Thumbnail &&thumb);
+        void erase(Object::Handle handle);
+
+    private:
+        using Entry = std::pair<Object::Handle, Thumbnail>;
+
+        static inline std::size_t cost(const Thumbnail &thumb) {
+            return thumb.data.size() + entry_overhead;
+        }
+
+    private:
+        std::list<Entry>                                               entries; // Most recently used first
+        std::unordered_map<Object::Handle, std::list<Entry>::iterator> lookup;
+        std::size_t                                                    size   = 0;
+        std::size_t                                                    budget = 0;
+};
+
+} // namespace nq::mtp::thumbs
@@ -0,0 +1,382 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+
+#include "tar.hpp"
+
+namespace nq::fs {
+
+namespace tar {
+
+// Octal with a terminator, or GNU base-256 when the value doesn't fit the field
+static void put_number(char *field, std::size_t width, std::uint64_t value) {
+    if (value >> (3 * (width - 1))) {
+        field[0] = static_cast<char>(0x80);
+        for (auto i = width - 1; i > 0; --i, value >>= 8)
+            field[i] = static_cast<char>(value & 0xff);
+        return;
+    }
+    std::snprintf(field, width, "%0*lo", static_cast<int>(width - 1), value);
+}
+
+static void append_header(std::vector<std::uint8_t> &out, std::string_view name, std::uint64_t size,
+        std::uint64_t mtime, char type) {
+    Header header = {};
+    std::memcpy(header.name, name.data(), std::min(name.size(), sizeof(header.name)));
+    put_number(header.mode,  sizeof(header.mode),  (type == type_directory) ? 0755 : 0644);
+    put_number(header.uid,   sizeof(header.uid),   0);
+    put_number(header.gid,   sizeof(header.gid),   0);
+    put_number(header.size,  sizeof(header.size),  size);
+    put_number(header.mtime, sizeof(header.mtime), mtime);
+    header.type = type;
+    std::memcpy(header.magic,   "ustar", sizeof(header.magic));
+    std::memcpy(header.version, "00",    sizeof(header.version));
+
+    // Checksum of the header with its own field as spaces, stored as 6 digits, a terminator and a space
+    std::memset(header.checksum, ' ', sizeof(header.checksum));
+    std::uint32_t checksum = 0;
+    for (std::size_t i = 0; i < sizeof(header); ++i)
+        checksum += reinterpret_cast<const std::uint8_t *>(&header)[i];
+    std::snprintf(header.checksum, sizeof(header.checksum) - 1, "%06o", checksum);
+
+    auto *bytes = reinterpret_cast<const std::uint8_t *>(&header);
+    out.insert(out.end(), bytes, bytes + sizeof(header));
+}
+
+// Octal, possibly space-padded, or GNU base-256
+static std::uint64_t get_number(const char *field, std::size_t width) {
+    std::uint64_t value = 0;
+    if (field[0] & 0x80) {
+        value = field[0] & 0x7f;
+        for (std::size_t i = 1; i < width; ++i)
+            value = (value << 8) | static_cast<std::uint8_t>(field[i]);
+        return value;
+    }
+
+    std::size_t i = 0;
+    while ((i < width) && (field[i] == ' '))
+        ++i;
+    for (; (i < width) && (field[i] >= '0') && (field[i] <= '7'); ++i)
+        value = (value << 3) | (field[i] - '0');
+    return value;
+}
+
+static std::string get_string(const char *field, std::size_t width) {
+    return std::string(field, strnlen(field, width));
+}
+
+// Relative path without '.' or empty components, empty when it would escape the destination
+static std::string sanitize_name(std::string_view name) {
+    std::string out;
+    while (!name.empty()) {
+        auto pos  = name.find('/');
+        auto part = name.substr(0, pos);
+        name = (pos == std::string_view::npos) ? std::string_view() : name.substr(pos + 1);
+
+        if (part.empty() || (part == "."))
+            continue;
+        if (part == "..")
+            return {};
+        if (!out.empty())
+            out += '/';
+        out += part;
+    }
+    return out;
+}
+
+} // namespace tar
+
+void TarStream::make_header(const Entry &entry) {
+    this->header.clear();
+    this->header_offset = 0;
+
+    if (entry.name.size() > sizeof(tar::Header::name)) {
+        tar::append_header(this->header, "././@LongLink", entry.name.size() + 1, 0, tar::type_long_name);
+        this->header.insert(this->header.end(), entry.name.begin(), entry.name.end());
+        this->header.resize(tar::round_up(this->header.size() + 1));
+    }
+
+    tar::append_header(this->header, entry.name, entry.size, entry.mtime,
+        entry.is_directory ? tar::type_directory : tar::type_file);
+}
+
+std::size_t TarStream::read(void *buf, std::size_t size) {
+    auto *out = static_cast<std::uint8_t *>(buf);
+    std::size_t written = 0;
+
+    while (written < size) {
+        switch (this->phase) {
+            case Phase::Header: {
+                    if (this->cur_entry == this->entries.size()) {
+                        this->phase     = Phase::End;
+                        this->remaining = 2 * tar::block_size;
+                        break;
+                    }
+
+                    auto &entry = this->entries[this->cur_entry];
+                    if (this->header_offset == 0)
+                        this->make_header(entry);
+
+                    auto len = std::min(this->header.size() - this->header_offset, size - written);
+                    std::copy_n(this->header.data() + this->header_offset, len, out + written);
+                    this->header_offset += len, written += len;
+
+                    if (this->header_offset == this->header.size()) {
+                        this->header_offset = 0;
+                        this->data_offset   = 0;
+                        if (entry.is_directory)
+                            ++this->cur_entry;
+                        else
+                            this->phase = Phase::Data;
+                    }
+                } break;
+            case Phase::Data: {
+                    auto &entry = this->entries[this->cur_entry];
+                    if ((this->data_offset == 0) && entry.size) {
+                        this->file_open = this->fs.open_file(this->file, entry.path).succeeded();
+                        if (!this->file_open)
+                            ERROR("Failed to open %s, archiving zeroes instead\n", entry.path.c_str());
+                    }
+
+                    auto len  = static_cast<std::size_t>(std::min<std::uint64_t>(entry.size - this->data_offset, size - written));
+                    auto read = this->file_open ? this->file.read(out + written, len, this->data_offset) : 0;
+                    std::fill_n(out + written + read, len - read, 0);
+                    this->data_offset += len, written += len;
+
+                    if (this->data_offset == entry.size) {
+                        if (this->file_open)
+                            this->file.close();
+                        this->file_open = false;
+                        this->phase     = Phase::Padding;
+                        this->remaining = tar::round_up(entry.size) - entry.size;
+                    }
+                } break;
+            case Phase::Padding:
+            case Phase::End: {
+                    auto len = static_cast<std::size_t>(std::min<std::uint64_t>(this->remaining, size - written));
+                    std::fill_n(out + written, len, 0);
+                    this->remaining -= len, written += len;
+
+                    if (this->remaining == 0) {
+                        if (this->phase == Phase::Padding)
+                            ++this->cur_entry, this->phase = Phase::Header;
+                        else
+                            this->phase = Phase::Done;
+                    }
+                } break;
+            case Phase::Done:
+                return written;
+        }
+    }
+
+    return written;
+}
+
+void TarExtractor::feed(const void *data, std::size_t size) {
+    auto *in = static_cast<const std::uint8_t *>(data);
+
+    while (size) {
+        switch (this->phase) {
+            case Phase::Header: {
+                    auto len = std::min(tar::block_size - this->block_fill, size);
+                    std::copy_n(in, len, this->block.data() + this->block_fill);
+                    this->block_fill += len, in += len, size -= len;
+
+                    if (this->block_fill == tar::block_size) {
+                        this->block_fill = 0;
+                        this->begin_entry();
+                    }
+                } break;
+            case Phase::Data: {
+                    auto len = static_cast<std::size_t>(std::min<std::uint64_t>(this->remaining, size));
+                    if ((this->target == Target::File) && this->file_open) {
+                        if (auto rc = this->file.write(in, len, this->data_offset); rc.failed()) {
+                            this->fail(rc);
+                            this->file.close();
+                            this->file_open = false;
+                        }
+                    } else if (this->target == Target::Meta) {
+                        this->meta.append(reinterpret_cast<const char *>(in), std::min(len, max_meta_size - this->meta.size()));
+                    }
+                    this->data_offset += len, this->remaining -= len, in += len, size -= len;
+
+                    if (this->remaining == 0)
+                        this->end_entry();
+                } break;
+            case Phase::Padding: {
+                    auto len = static_cast<std::size_t>(std::min<std::uint64_t>(this->remaining, size));
+                    this->remaining -= len, in += len, size -= len;
+                    if (this->remaining == 0)
+                        this->phase = Phase::Header;
+                } break;
+            case Phase::End:
+                return;
+        }
+    }
+}
+
+Result TarExtractor::finish() {
+    // Archives without the end-of-archive blocks are accepted as long as they end on an entry boundary
+    if ((this->phase != Phase::End) && ((this->phase != Phase::Header) || this->block_fill)) {
+        ERROR("Archive was cut short\n");
+        this->fail(Result::failure());
+    }
+
+    if (this->file_open)
+        this->file.close();
+    this->file_open = false;
+    return this->rc;
+}
+
+void TarExtractor::begin_entry() {
+    auto &header = *reinterpret_cast<const tar::Header *>(this->block.data());
+
+    if (std::all_of(this->block.begin(), this->block.end(), [](std::uint8_t b) { return b == 0; })) {
+        this->phase = Phase::End;
+        return;
+    }
+
+    // The checksum field is summed as spaces
+    std::uint32_t checksum = 0;
+    for (std::size_t i = 0; i < this->block.size(); ++i)
+        checksum += ((i >= offsetof(tar::Header, checksum)) && (i < offsetof(tar::Header, type))) ? ' ' : this->block[i];
+    if (checksum != tar::get_number(header.checksum, sizeof(header.checksum))) {
+        // Nothing after a corrupt header can be trusted
+        ERROR("Bad tar header checksum\n");
+        this->fail(Result::failure());
+        this->phase = Phase::End;
+        return;
+    }
+
+    this->type        = header.type;
+    this->entry_size  = this->has_pax_size ? this->pax_size : tar::get_number(header.size, sizeof(header.size));
+    this->data_offset = 0;
+    this->remaining   = this->entry_size;
+    this->target      = Target::Skip;
+
+    if ((this->type == tar::type_long_name) || (this->type == tar::type_pax)) {
+        this->meta.clear();
+        this->target = Target::Meta;
+    } else {
+        // Overrides from the preceding metadata entries only apply to this one
+        auto name = !this->long_name.empty() ? this->long_name : !this->pax_path.empty() ? this->pax_path : [&] {
+            auto name = tar::get_string(header.name, sizeof(header.name));
+            if (!std::memcmp(header.magic, "ustar", 5) && header.prefix[0])
+                name = tar::get_string(header.prefix, sizeof(header.prefix)) + '/' + name;
+            return name;
+        }();
+        this->long_name.clear(), this->pax_path.clear(), this->has_pax_size = false;
+
+        this->name = tar::sanitize_name(name);
+        if (this->name.empty()) {
+            if (!name.empty() && (name != "./") && (name != "."))
+                ERROR("Skipping unsafe archive entry %s\n", name.c_str());
+        } else if (this->type == tar::type_directory) {
+            if (this->make_directory(this->name))
+                ++this->nb_entries;
+        } else if ((this->type == tar::type_file) || (this->type == tar::type_file_old) || (this->type == tar::type_contiguous)) {
+            auto pos = this->name.rfind('/');
+            if ((pos == std::string::npos) || this->make_directory(this->name.substr(0, pos))) {
+                // Existing files are replaced
+                auto path = this->destination + this->name;
+                auto rc = this->fs.create_file(path, this->entry_size);
+                if (rc.failed() && this->fs.delete_file(path).succeeded())
+                    rc = this->fs.create_file(path, this->entry_size);
+                if (rc.succeeded())
+                    rc = this->fs.open_file(this->file, path, FsOpenMode_Write);
+
+                this->file_open = rc.succeeded();
+                if (this->file_open)
+                    this->target = Target::File;
+                else
+                    this->fail(rc);
+            }
+        }
+    }
+
+    this->phase = Phase::Data;
+    if (this->remaining == 0)
+        this->end_entry();
+}
+
+void TarExtractor::end_entry() {
+    if (this->target == Target::File) {
+        if (this->file_open) {
+            this->file.close();
+            this->file_open = false;
+            this->callback(this->name, false, this->entry_size);
+            ++this->nb_entries;
+        }
+    } else if (this->target == Target::Meta) {
+        if (this->type == tar::type_long_name)
+            this->long_name = this->meta.c_str(); // Drop the terminator
+        else
+            this->parse_pax();
+    }
+
+    this->remaining = tar::round_up(this->entry_size) - this->entry_size;
+    this->phase     = this->remaining ? Phase::Padding : Phase::Header;
+}
+
+void TarExtractor::parse_pax() {
+    // Records are "<length> <key>=<value>\n", the length counting the whole record
+    std::string_view records = this->meta;
+    while (!records.empty()) {
+        auto space = records.find(' ');
+        if (space == std::string_view::npos)
+            return;
+
+        std::size_t length = 0;
+        for (auto c: records.substr(0, space)) {
+            if ((c < '0') || (c > '9'))
+                return;
+            length = length * 10 + (c - '0');
+        }
+        if ((length <= space + 1) || (length > records.size()))
+            return;
+
+        auto record = records.substr(space + 1, length - space - 2);
+        records.remove_prefix(length);
+
+        auto equal = record.find('=');
+        if (equal == std::string_view::npos)
+            continue;
+
+        auto key = record.substr(0, equal), value = record.substr(equal + 1);
+        if (key == "path") {
+            this->pax_path = value;
+        } else if (key == "size") {
+            this->pax_size = 0;
+            for (auto c: value)
+                this->pax_size = this->pax_size * 10 + (c - '0');
+            this->has_pax_size = true;
+        }
+    }
+}
+
+bool TarExtractor::make_directory(const std::string &name) {
+    if (this->directories.count(name))
+        return true;
+
+    // Parents first, archives don't always list them
+    if (auto pos = name.rfind('/'); (pos != std::string::npos) && !this->make_directory(name.substr(0, pos)))
+        return false;
+
+    // Already existing directories are fine, anything else will surface when creating their contents
+    auto path = this->destination + name;
+    if (auto rc = this->fs.create_directory(path); rc.failed()) {
+        fs::Directory dir;
+        if (this->fs.open_directory(dir, path).failed()) {
+            this->fail(rc);
+            return false;
+        }
+        dir.close();
+    }
+
+    this->directories.insert(name);
+    this->callback(name, true, 0);
+    return true;
+}
+
+} // namespace nq::fs
@@ -0,0 +1,208 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <vector>
+#include <switch.h>
+
+#include "fs.hpp"
+#include "utils.hpp"
+
+namespace nq::fs {
+
+namespace tar {
+
+constexpr inline std::size_t block_size = 512;
+
+struct Header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char checksum[8];
+    char type;
+    char link_name[100];
+    char magic[6];
+    char version[2];
+    char user_name[32];
+    char group_name[32];
+    char dev_major[8];
+    char dev_minor[8];
+    char prefix[155];
+    char padding[12];
+};
+ASSERT_SIZE(Header, block_size);
+ASSERT_STANDARD_LAYOUT(Header);
+
+constexpr inline char type_file        = '0';
+constexpr inline char type_file_old    = '\0'; // Pre-POSIX archives
+constexpr inline char type_contiguous  = '7';
+constexpr inline char type_directory   = '5';
+constexpr inline char type_long_name   = 'L'; // GNU extension, the data is the name of the next entry
+constexpr inline char type_pax         = 'x'; // POSIX extended header, records overriding fields of the next entry
+
+constexpr inline std::uint64_t round_up(std::uint64_t size) {
+    return (size + block_size - 1) & ~static_cast<std::uint64_t>(block_size - 1);
+}
+
+} // namespace tar
+
+// Generates a tar archive on the fly from files and directories, without a temporary copy. Entries use the ustar
+// layout, with the GNU extensions for names over 100 bytes and sizes over 8 GiB. The archive size is fixed once the
+// entries are added, files that changed size since are truncated or zero-padded to match it
+class TarStream {
+    NON_COPYABLE(TarStream);
+    NON_MOVEABLE(TarStream);
+
+    public:
+        TarStream(Filesystem &fs): fs(fs) { }
+
+        inline ~TarStream() {
+            if (this->file_open)
+                this->file.close();
+        }
+
+        // Names are relative to the archive root, directory names end with a slash
+        inline void add_directory(std::string name, std::uint64_t mtime) {
+            this->total_size += header_size(name);
+            this->entries.push_back({ {}, std::move(name), 0, mtime, true });
+        }
+
+        inline void add_file(std::string path, std::string name, std::uint64_t size, std::uint64_t mtime) {
+            this->total_size += header_size(name) + tar::round_up(size);
+            this->entries.push_back({ std::move(path), std::move(name), size, mtime, false });
+        }
+
+        // Including the two zero blocks ending the archive
+        inline std::uint64_t get_size() const {
+            return this->total_size + 2 * tar::block_size;
+        }
+
+        // Fills buf with the next bytes of the archive, returns less than size only at the end
+        std::size_t read(void *buf, std::size_t size);
+
+    private:
+        struct Entry {
+            std::string   path, name;
+            std::uint64_t size, mtime;
+            bool          is_directory;
+        };
+
+        enum class Phase {
+            Header,
+            Data,
+            Padding,
+            End,
+            Done,
+        };
+
+        static inline std::uint64_t header_size(std::string_view name) {
+            if (name.size() <= sizeof(tar::Header::name))
+                return tar::block_size;
+            return 2 * tar::block_size + tar::round_up(name.size() + 1);
+        }
+
+        void make_header(const Entry &entry);
+
+    private:
+        Filesystem        &fs;
+        std::vector<Entry> entries;
+        std::uint64_t      total_size = 0;
+
+        Phase                     phase = Phase::Header;
+        std::size_t               cur_entry = 0;
+        std::vector<std::uint8_t> header;
+        std::size_t               header_offset = 0;
+        File                      file;
+        bool                      file_open = false;
+        std::uint64_t             data_offset = 0, remaining = 0;
+};
+
+// Unpacks a tar archive fed in arbitrary chunks, as it arrives. Supports ustar, the GNU long names and the path/size
+// records of pax headers. Leading slashes are stripped, names escaping the destination and special files are skipped.
+// Failures don't stop parsing, so that the remainder of the stream is still consumed in sync
+class TarExtractor {
+    NON_COPYABLE(TarExtractor);
+    NON_MOVEABLE(TarExtractor);
+
+    public:
+        constexpr static std::size_t max_meta_size = 0x10000; // For long names and pax headers
+
+        // Called once an entry is written, with its name relative to the destination. Parent directories are
+        // always reported before their contents, including the ones the archive doesn't list
+        using EntryCallback = std::function<void(std::string_view name, bool is_directory, std::uint64_t size)>;
+
+        // The destination path ends with a slash
+        TarExtractor(Filesystem &fs, std::string destination, EntryCallback callback):
+            fs(fs), destination(std::move(destination)), callback(std::move(callback)) { }
+
+        inline ~TarExtractor() {
+            if (this->file_open)
+                this->file.close();
+        }
+
+        void feed(const void *data, std::size_t size);
+
+        // Fails if the archive was cut short or an entry couldn't be written
+        Result finish();
+
+        inline std::uint32_t get_nb_entries() const {
+            return this->nb_entries;
+        }
+
+    private:
+        enum class Phase {
+            Header,
+            Data,
+            Padding,
+            End,
+        };
+
+        enum class Target {
+            Skip,
+            File,
+            Meta,
+        };
+
+        void begin_entry();
+        void end_entry();
+        void parse_pax();
+        bool make_directory(const std::string &name);
+
+        inline void fail(Result rc) {
+            if (this->rc.succeeded())
+                this->rc = rc;
+        }
+
+    private:
+        Filesystem   &fs;
+        std::string   destination;
+        EntryCallback callback;
+
+        Phase                                     phase = Phase::Header;
+        std::array<std::uint8_t, tar::block_size> block;
+        std::size_t                               block_fill = 0;
+
+        char          type   = 0;
+        Target        target = Target::Skip;
+        std::string   name, long_name, pax_path;
+        std::uint64_t pax_size = 0;
+        bool          has_pax_size = false;
+        std::string   meta;
+
+        File          file;
+        bool          file_open = false;
+        std::uint64_t entry_size = 0, data_offset = 0, remaining = 0;
+
+        std::unordered_set<std::string> directories; // Created or reported already
+        std::uint32_t                   nb_entries = 0;
+        Result                          rc = Result::success();
+};
+
+} // namespace nq::fs
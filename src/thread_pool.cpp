@@ -0,0 +1,97 @@
+#include "thread_pool.hpp"
+
+namespace nq {
+
+ThreadPool::ThreadPool(std::size_t nb_workers) {
+    this->workers.reserve(nb_workers);
+    for (std::size_t i = 0; i < nb_workers; ++i) {
+        Thread thread;
+
+        // Cores 0-2 are available to applications, fall back to the default core in restricted modes
+        if (R_FAILED(threadCreate(&thread, &ThreadPool::worker_func, this, nullptr, stack_size, priority, i % 3)) &&
+                R_FAILED(threadCreate(&thread, &ThreadPool::worker_func, this, nullptr, stack_size, priority, -2))) {
+            ERROR("Failed to create worker thread %zu\n", i);
+            break;
+        }
+
+        // Only started threads are waited on at exit, parallel_for copes with fewer workers
+        if (R_FAILED(threadStart(&thread))) {
+            ERROR("Failed to start worker thread %zu\n", i);
+            threadClose(&thread);
+            break;
+        }
+
+        this->workers.push_back(thread);
+    }
+
+    TRACE("Started thread pool with %zu workers\n", this->workers.size());
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard lk(this->mutex);
+        this->exiting = true;
+    }
+    this->work_cv.notify_all();
+
+    for (auto &&thread: this->workers) {
+        threadWaitForExit(&thread);
+        threadClose(&thread);
+    }
+}
+
+bool ThreadPool::claim(std::size_t &idx, const Job *&job) {
+    if (!this->job || (this->next >= this->count))
+        return false;
+
+    idx = this->next++, job = this->job;
+    ++this->nb_busy;
+    return true;
+}
+
+void ThreadPool::parallel_for(std::size_t count, const Job &job) {
+    if (this->workers.empty() || (count <= 1)) {
+        for (std::size_t i = 0; i < count; ++i)
+            job(i);
+        return;
+    }
+
+    std::unique_lock lk(this->mutex);
+    this->job = &job, this->count = count, this->next = 0;
+    this->work_cv.notify_all();
+
+    std::size_t idx; const Job *j;
+    while (this->claim(idx, j)) {
+        lk.unlock();
+        job(idx);
+        lk.lock();
+        --this->nb_busy;
+    }
+
+    this->done_cv.wait(lk, [this] { return this->nb_busy == 0; });
+    this->job = nullptr;
+}
+
+void ThreadPool::worker_func(void *args) {
+    auto *self = static_cast<ThreadPool *>(args);
+
+    std::unique_lock lk(self->mutex);
+    while (true) {
+        self->work_cv.wait(lk, [self] { return self->exiting || (self->job && (self->next < self->count)); });
+        if (self->exiting)
+            break;
+
+        std::size_t idx; const Job *job;
+        while (self->claim(idx, job)) {
+            lk.unlock();
+            (*job)(idx);
+            lk.lock();
+            --self->nb_busy;
+        }
+
+        if (self->nb_busy == 0)
+            self->done_cv.notify_all();
+    }
+}
+
+} // namespace nq
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <switch.h>
+
+#include "utils.hpp"
+
+namespace nq {
+
+// Small fixed-size pool for fs-bound work. Workers are spread over the cores available to applications,
+// the calling thread takes part in the work instead of sleeping
+class ThreadPool {
+    NON_COPYABLE(ThreadPool);
+    NON_MOVEABLE(ThreadPool);
+
+    public:
+        using Job = std::function<void(std::size_t)>;
+
+        constexpr static std::size_t stack_size = 0x10000;
+        constexpr static int         priority   = 0x2c;
+
+        ThreadPool(std::size_t nb_workers);
+        ~ThreadPool();
+
+        inline std::size_t size() const {
+            return this->workers.size();
+        }
+
+        // Runs job(0) to job(count - 1) concurrently, and returns once all of them completed
+        void parallel_for(std::size_t count, const Job &job);
+
+    private:
+        static void worker_func(void *args);
+
+        // Claims the next pending index of the current job, with the mutex held
+        bool claim(std::size_t &idx, const Job *&job);
+
+    private:
+        std::vector<Thread>     workers;
+        std::mutex              mutex;
+        std::condition_variable work_cv, done_cv;
+
+        const Job  *job     = nullptr;
+        std::size_t count   = 0;
+        std::size_t next    = 0;
+        std::size_t nb_busy = 0;
+        bool        exiting = false;
+};
+
+} // namespace nq
@@ -19,6 +19,7 @@ UsbDsEndpoint        *g_endpoint_in, *g_endpoint_out, *g_endpoint_interr;
 // Buffers must be page-aligned
 alignas(0x1000) std::uint8_t g_endpoint_in_buf[endpoint_buffer_size * num_buffers];
 alignas(0x1000) std::uint8_t g_endpoint_out_buf[endpoint_buffer_size * num_buffers];
+alignas(0x1000) std::uint8_t g_endpoint_interr_buf[0x1000];
 std::uint8_t g_endpoint_in_cur_buf_idx = 0, g_endpoint_out_cur_buf_idx = 0;
 
 std::atomic<UsbState> g_state = UsbState::Finalized;
@@ -302,4 +303,12 @@ Result receive(void *buf, std::size_t size, std::size_t *out) {
     return Result::success();
 }
 
+Result send_event(const void *buf, std::size_t size, std::size_t *out) {
+    std::uint32_t urb_id;
+    auto chunk_size = std::min(size, sizeof(g_endpoint_interr_buf));
+    std::copy_n(reinterpret_cast<const std::uint8_t *>(buf), chunk_size, g_endpoint_interr_buf);
+    R_TRY_RETURN(begin_xfer(g_endpoint_interr, g_endpoint_interr_buf, chunk_size, &urb_id));
+    return wait_xfer(g_endpoint_interr, urb_id, to_ns(100ms), out);
+}
+
 } // namespace nq::usb
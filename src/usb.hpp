@@ -67,6 +67,9 @@ Result wait_xfer(UsbDsEndpoint *endpoint, std::uint32_t urb_id, std::uint64_t ti
 Result send(const void *buf, std::size_t size, std::size_t *out_size);
 Result receive(void *buf, std::size_t size, std::size_t *out_size);
 
+// Sent on the interrupt endpoint, gives up if the host isn't polling it
+Result send_event(const void *buf, std::size_t size, std::size_t *out_size);
+
 inline Result set_zlt(UsbDsEndpoint *endpoint, bool zlt = true) {
     return usbDsEndpoint_SetZlt(endpoint, zlt);
 }
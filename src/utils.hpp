@@ -6,6 +6,7 @@
 #include <chrono>
 #include <functional>
 #include <string>
+#include <string_view>
 #include <type_traits>
 #include <switch.h>
 
@@ -48,6 +49,37 @@ static inline std::string to_utf8(const std::u16string &str) {
     return std::string(str.begin(), str.end());
 }
 
+// 64-bit FNV-1a, used to fingerprint directory listings
+static inline std::uint64_t fnv1a(const void *data, std::size_t size, std::uint64_t hash = 0xcbf29ce484222325) {
+    auto *bytes = static_cast<const std::uint8_t *>(data);
+    for (std::size_t i = 0; i < size; ++i)
+        hash = (hash ^ bytes[i]) * 0x100000001b3;
+    return hash;
+}
+
+// Wildcard match ('*' for any run of characters, '?' for any single one), ignoring ascii case
+static inline bool glob_match(std::string_view pattern, std::string_view str) {
+    auto lower = [](char c) { return ((c >= 'A') && (c <= 'Z')) ? c - 'A' + 'a' : c; };
+
+    // On mismatch, backtrack to the last star and let it swallow one more character
+    std::size_t p = 0, s = 0, star = std::string_view::npos, mark = 0;
+    while (s < str.size()) {
+        if ((p < pattern.size()) && (pattern[p] == '*')) {
+            star = p++, mark = s;
+        } else if ((p < pattern.size()) && ((pattern[p] == '?') || (lower(pattern[p]) == lower(str[s])))) {
+            ++p, ++s;
+        } else if (star != std::string_view::npos) {
+            p = star + 1, s = ++mark;
+        } else {
+            return false;
+        }
+    }
+
+    while ((p < pattern.size()) && (pattern[p] == '*'))
+        ++p;
+    return p == pattern.size();
+}
+
 class ScopeGuard {
     NON_COPYABLE(ScopeGuard);
     NON_MOVEABLE(ScopeGuard);
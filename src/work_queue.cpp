@@ -0,0 +1,80 @@
+#include "work_queue.hpp"
+
+namespace nq {
+
+WorkQueue::WorkQueue() {
+    R_TRY_RETURNV(threadCreate(&this->thread, &WorkQueue::worker_func, this, nullptr, stack_size, priority, -2), );
+    if (R_FAILED(threadStart(&this->thread))) {
+        ERROR("Failed to start work queue thread\n");
+        threadClose(&this->thread);
+        return;
+    }
+    this->thread_started = true;
+}
+
+WorkQueue::~WorkQueue() {
+    if (!this->thread_started)
+        return;
+
+    {
+        std::lock_guard lk(this->mutex);
+        this->exiting = true;
+    }
+    this->cv.notify_all();
+
+    threadWaitForExit(&this->thread);
+    threadClose(&this->thread);
+}
+
+void WorkQueue::push(Job job, Job completion) {
+    // Without a worker, run everything inline
+    if (!this->thread_started) {
+        job();
+        if (completion)
+            completion();
+        return;
+    }
+
+    {
+        std::lock_guard lk(this->mutex);
+        this->jobs.push_back({ std::move(job), std::move(completion) });
+    }
+    this->cv.notify_one();
+}
+
+std::size_t WorkQueue::poll() {
+    std::vector<Job> completions;
+    {
+        std::lock_guard lk(this->mutex);
+        std::swap(completions, this->completions);
+    }
+
+    for (auto &&completion: completions)
+        completion();
+    return completions.size();
+}
+
+void WorkQueue::worker_func(void *args) {
+    auto *self = static_cast<WorkQueue *>(args);
+
+    std::unique_lock lk(self->mutex);
+    while (true) {
+        self->cv.wait(lk, [self] { return self->exiting || !self->jobs.empty(); });
+        if (self->jobs.empty())
+            break;
+
+        auto entry = std::move(self->jobs.front());
+        self->jobs.pop_front();
+        self->busy = true;
+
+        lk.unlock();
+        entry.job();
+        lk.lock();
+
+        self->busy = false;
+        if (entry.completion)
+            self->completions.push_back(std::move(entry.completion));
+    }
+}
+
+} // namespace nq
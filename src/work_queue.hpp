@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cstdint>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+#include <switch.h>
+
+#include "utils.hpp"
+
+namespace nq {
+
+// Background worker for jobs that shouldn't hold up requests. Jobs run in order on a dedicated thread,
+// and their completions are deferred to whichever thread polls the queue, so that shared state
+// (the object index) is only ever touched from there
+class WorkQueue {
+    NON_COPYABLE(WorkQueue);
+    NON_MOVEABLE(WorkQueue);
+
+    public:
+        using Job = std::function<void()>;
+
+        constexpr static std::size_t stack_size = 0x10000;
+        constexpr static int         priority   = 0x30; // Below the server thread
+
+        WorkQueue();
+        ~WorkQueue(); // Finishes pending jobs
+
+        void push(Job job, Job completion = {});
+
+        // Runs completions of finished jobs, returns how many ran
+        std::size_t poll();
+
+        inline bool is_idle() {
+            std::lock_guard lk(this->mutex);
+            return this->jobs.empty() && !this->busy;
+        }
+
+    private:
+        struct Entry {
+            Job job, completion;
+        };
+
+        static void worker_func(void *args);
+
+    private:
+        Thread                  thread = {};
+        bool                    thread_started = false;
+        std::mutex              mutex;
+        std::condition_variable cv;
+        std::deque<Entry>       jobs;
+        std::vector<Job>        completions;
+        bool                    busy = false, exiting = false;
+};
+
+} // namespace nq